@@ -0,0 +1,129 @@
+#include "freeblocktree.h"
+#include <cassert>
+
+void FreeBlockTree::insert(FreeBlockTreeNode *node, std::size_t size)
+{
+    node->left = nullptr;
+    node->right = nullptr;
+    node->size = size;
+    m_root = insert_below(m_root, node);
+}
+
+void FreeBlockTree::erase(FreeBlockTreeNode *node)
+{
+    m_root = erase_below(m_root, node);
+}
+
+FreeBlockTreeNode* FreeBlockTree::best_fit(std::size_t size) const
+{
+    FreeBlockTreeNode *best = nullptr;
+    FreeBlockTreeNode *curr = m_root;
+    while(curr != nullptr)
+    {
+        if(curr->size >= size)
+        {
+            //curr fits, but there might be a smaller (or equally large, lower addressed) one to the left
+            best = curr;
+            curr = curr->left;
+        }
+        else
+        {
+            curr = curr->right;
+        }
+    }
+    return best;
+}
+
+/*!
+ * \brief Inserts node into the subtree given by root and returns the new root of that subtree. Rotates node upwards as long as its priority is higher than its parent's.
+ * \param root
+ * \param node
+ * \return
+ */
+FreeBlockTreeNode* FreeBlockTree::insert_below(FreeBlockTreeNode *root, FreeBlockTreeNode *node)
+{
+    if(root == nullptr)
+    {
+        return node;
+    }
+
+    if(less(node, root))
+    {
+        root->left = insert_below(root->left, node);
+        if(priority(root->left) > priority(root))
+        {
+            //rotate right
+            FreeBlockTreeNode *newroot = root->left;
+            root->left = newroot->right;
+            newroot->right = root;
+            return newroot;
+        }
+    }
+    else
+    {
+        root->right = insert_below(root->right, node);
+        if(priority(root->right) > priority(root))
+        {
+            //rotate left
+            FreeBlockTreeNode *newroot = root->right;
+            root->right = newroot->left;
+            newroot->left = root;
+            return newroot;
+        }
+    }
+    return root;
+}
+
+/*!
+ * \brief Removes node from the subtree given by root and returns the new root of that subtree
+ * \param root
+ * \param node
+ * \return
+ */
+FreeBlockTreeNode* FreeBlockTree::erase_below(FreeBlockTreeNode *root, FreeBlockTreeNode *node)
+{
+    //If this fails, node was not in the tree or its size was changed while it was in the tree
+    assert(root != nullptr);
+
+    if(root == node)
+    {
+        return merge(node->left, node->right);
+    }
+
+    if(less(node, root))
+    {
+        root->left = erase_below(root->left, node);
+    }
+    else
+    {
+        root->right = erase_below(root->right, node);
+    }
+    return root;
+}
+
+/*!
+ * \brief Joins two subtrees where every key in left is smaller than every key in right
+ * \param left
+ * \param right
+ * \return
+ */
+FreeBlockTreeNode* FreeBlockTree::merge(FreeBlockTreeNode *left, FreeBlockTreeNode *right)
+{
+    if(left == nullptr)
+    {
+        return right;
+    }
+    if(right == nullptr)
+    {
+        return left;
+    }
+
+    if(priority(left) > priority(right))
+    {
+        left->right = merge(left->right, right);
+        return left;
+    }
+
+    right->left = merge(left, right->left);
+    return right;
+}
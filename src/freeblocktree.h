@@ -0,0 +1,69 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+/*Intrusive search tree over free blocks, used for best-fit searches in the large size classes of MyAlloc.
+The nodes live inside the payload of the free blocks themselves, so the tree never allocates.
+Nodes are ordered by (size, address), so the first node with a size >= the requested size is the best fit,
+and among equally good fits the one with the lowest address wins.
+The tree is a treap whose priorities are derived from the node addresses, which keeps it balanced in expectation without storing a priority. */
+
+struct FreeBlockTreeNode
+{
+    FreeBlockTreeNode *left;
+    FreeBlockTreeNode *right;
+    std::size_t size;
+};
+
+class FreeBlockTree
+{
+public:
+    /*!
+     * \brief Inserts node with the key size. node must not already be in the tree.
+     * \param node
+     * \param size
+     */
+    void insert(FreeBlockTreeNode *node, std::size_t size);
+
+    /*!
+     * \brief Removes node, which must be in the tree and must still carry the size it was inserted with
+     * \param node
+     */
+    void erase(FreeBlockTreeNode *node);
+
+    /*!
+     * \brief Returns the node with the smallest size >= size, the lowest addressed one if there are several, or nullptr
+     * \param size
+     * \return
+     */
+    [[nodiscard]] FreeBlockTreeNode* best_fit(std::size_t size) const;
+
+    [[nodiscard]] bool empty() const
+    {
+        return m_root == nullptr;
+    }
+
+private:
+    [[nodiscard]] static bool less(const FreeBlockTreeNode *a, const FreeBlockTreeNode *b)
+    {
+        return a->size < b->size || (a->size == b->size && a < b);
+    }
+
+    //Pseudo-random but fixed priority of a node, mixed from its address
+    [[nodiscard]] static std::uint64_t priority(const FreeBlockTreeNode *node)
+    {
+        std::uint64_t x = reinterpret_cast<std::uintptr_t>(node);
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccdULL;
+        x ^= x >> 33;
+        return x;
+    }
+
+    [[nodiscard]] static FreeBlockTreeNode* insert_below(FreeBlockTreeNode *root, FreeBlockTreeNode *node);
+
+    [[nodiscard]] static FreeBlockTreeNode* erase_below(FreeBlockTreeNode *root, FreeBlockTreeNode *node);
+
+    [[nodiscard]] static FreeBlockTreeNode* merge(FreeBlockTreeNode *left, FreeBlockTreeNode *right);
+
+    FreeBlockTreeNode *m_root{nullptr};
+};
@@ -1,17 +1,775 @@
 #include "myalloc.h"
 #include <stdexcept>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <algorithm>
+#include <cstring>
+#include <cstddef>
+#include <cerrno>
+#include <new>
+#include <fstream>
+#include <map>
+#include <shared_mutex>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 /*!
  * \brief MyAlloc::MyAlloc
  */
-MyAlloc::MyAlloc()
+MyAlloc::MyAlloc() : m_thread_cache_enabled{true}
 {
     mm_init();
 }
 
+MyAlloc::MyAlloc(int numa_node) : m_thread_cache_enabled{true}, m_numa_node{numa_node}
+{
+    mm_init();
+}
+
+//Allocators that thread caches may still be given back to, by instance id. Guards against flushing a cache into a destroyed allocator.
+struct InstanceRegistry
+{
+    std::mutex mutex;
+    std::map<std::uint64_t, MyAlloc*> instances;
+    std::uint64_t next_id{1};
+};
+
+//Constructed on first use, as allocators may be created during static initialization of other translation units
+static InstanceRegistry& instance_registry()
+{
+    static InstanceRegistry registry;
+    return registry;
+}
+
+std::uint64_t MyAlloc::register_instance(MyAlloc *alloc)
+{
+    InstanceRegistry &registry = instance_registry();
+    std::lock_guard<std::mutex> lock{registry.mutex};
+    registry.instances.emplace(registry.next_id, alloc);
+    return registry.next_id++;
+}
+
+//Anonymous slabs of all allocators by start address, so the allocator a block belongs to can be found without locking any allocator
+struct SlabDirectory
+{
+    std::shared_mutex mutex;
+    std::map<BYTE*, MyAlloc*> slabs;
+};
+
+static SlabDirectory& slab_directory()
+{
+    static SlabDirectory directory;
+    return directory;
+}
+
+/*!
+ * \brief Returns the allocator whose anonymous slabs contain ptr, or nullptr. Persistent heaps and shared arenas are not in the directory.
+ * \param ptr
+ * \return
+ */
+MyAlloc* MyAlloc::owner_of(void *ptr)
+{
+    SlabDirectory &directory = slab_directory();
+    std::shared_lock<std::shared_mutex> lock{directory.mutex};
+
+    auto it = directory.slabs.upper_bound(reinterpret_cast<BYTE*>(ptr));
+    if(it == directory.slabs.begin())
+    {
+        return nullptr;
+    }
+    --it;
+    return reinterpret_cast<BYTE*>(ptr) < it->first + SLAB_SIZE ? it->second : nullptr;
+}
+
+//Gives the thread cache back when its thread exits
+struct ThreadCacheFlusher
+{
+    ~ThreadCacheFlusher()
+    {
+        MyAlloc::flush_thread_cache();
+        MyAlloc::s_thread_cache.exited = true;
+    }
+};
+
+/*!
+ * \brief Gives the calling thread's cache back to the allocator it belongs to, and binds it to this one
+ * \return false if the thread is exiting and must not use its cache anymore
+ */
+bool MyAlloc::bind_thread_cache()
+{
+    if(s_thread_cache.exited)
+    {
+        return false;
+    }
+
+    //Constructed on first use in every thread, so that its destructor flushes the cache when the thread exits
+    static thread_local ThreadCacheFlusher flusher;
+    (void)flusher;
+
+    flush_thread_cache();
+
+    InstanceRegistry &registry = instance_registry();
+    std::lock_guard<std::mutex> lock{registry.mutex};
+    s_thread_cache.owner = this;
+    s_thread_cache.owner_id = m_instance_id;
+    m_thread_caches.push_back(&s_thread_cache);
+    return true;
+}
+
+/*!
+ * \brief Frees all blocks in the calling thread's cache in the allocator they belong to, if it still exists, and unbinds the cache
+ */
+void MyAlloc::flush_thread_cache()
+{
+    ThreadCache &cache = s_thread_cache;
+    if(cache.owner == nullptr)
+    {
+        return;
+    }
+
+    {
+        //Held while flushing, so the allocator cannot be destroyed in between
+        InstanceRegistry &registry = instance_registry();
+        std::lock_guard<std::mutex> registry_lock{registry.mutex};
+        auto it = registry.instances.find(cache.owner_id);
+        if(it != registry.instances.end() && it->second == cache.owner)
+        {
+            //Once the cache is off the owner's list, trim cannot reach it anymore, so it needs no locking
+            MyAlloc *owner = cache.owner;
+            owner->m_thread_caches.erase(std::find(owner->m_thread_caches.begin(), owner->m_thread_caches.end(), &cache));
+            std::lock_guard<HeapMutex> lock{owner->m_mutex};
+            owner->free_cached_blocks(cache);
+        }
+    }
+
+    cache.owner = nullptr;
+    cache.owner_id = 0;
+    cache.heads.fill(nullptr);
+    cache.counts.fill(0);
+}
+
+/*!
+ * \brief Empties the caches of all threads bound to this allocator, including idle ones, so that trim sees their blocks as free. The caches stay bound.
+ */
+void MyAlloc::drain_thread_caches()
+{
+    InstanceRegistry &registry = instance_registry();
+    std::lock_guard<std::mutex> registry_lock{registry.mutex};
+    if(m_thread_caches.empty())
+    {
+        return;
+    }
+
+    std::lock_guard<HeapMutex> lock{m_mutex};
+    for(ThreadCache *cache : m_thread_caches)
+    {
+        cache->lock();
+        free_cached_blocks(*cache);
+        cache->unlock();
+    }
+}
+
+/*!
+ * \brief Frees all blocks in cache in this allocator and leaves the cache empty. m_mutex must be held.
+ * \param cache
+ */
+void MyAlloc::free_cached_blocks(ThreadCache &cache)
+{
+    for(BYTE *&head : cache.heads)
+    {
+        while(head != nullptr)
+        {
+            BYTE *next = *reinterpret_cast<BYTE**>(head);
+            free_block(head);
+            head = next;
+        }
+    }
+    cache.counts.fill(0);
+}
+
+/*!
+ * \brief Constructs an allocator on the persistent heap in the file at path, see open_persistent
+ * \param path
+ * \param base
+ */
+MyAlloc::MyAlloc(const std::string &path, std::uintptr_t base)
+{
+    open_heap_file(path, base);
+}
+
+/*!
+ * \brief Constructs an allocator on a shared arena in memfd, which it takes ownership of. base == 0 attaches to an existing arena, otherwise a new one is created at base.
+ * \param memfd
+ * \param base
+ */
+MyAlloc::MyAlloc(int memfd, std::uintptr_t base)
+{
+    if(base != 0)
+    {
+        if(ftruncate(memfd, PERSISTENT_HEADER_REGION_SIZE) != 0)
+        {
+            close(memfd);
+            throw std::runtime_error("Cannot size shared arena");
+        }
+        map_heap(memfd, base, true, true, "shared arena");
+        return;
+    }
+
+    //The base address has to be known before the header can be mapped: read magic, version and base directly
+    std::array<std::uint64_t, 3> prefix{};
+    static_assert(offsetof(PersistentHeader, base) == 2 * sizeof(std::uint64_t));
+    if(pread(memfd, prefix.data(), sizeof(prefix), 0) != static_cast<ssize_t>(sizeof(prefix)) || prefix.at(0) != PERSISTENT_MAGIC)
+    {
+        close(memfd);
+        throw std::runtime_error("File descriptor does not refer to a shared arena");
+    }
+    map_heap(memfd, prefix.at(2), false, true, "shared arena");
+}
+
+/*!
+ * \brief MyAlloc::~MyAlloc stops the background trim thread, if it is running, and closes a persistent heap or shared arena. Anonymous slabs are not unmapped.
+ */
+MyAlloc::~MyAlloc()
+{
+    stop_background_trim();
+
+    if(s_thread_cache.owner == this)
+    {
+        flush_thread_cache();
+    }
+    {
+        //Caches of other threads that still refer to this allocator are dropped when they are flushed
+        InstanceRegistry &registry = instance_registry();
+        std::lock_guard<std::mutex> lock{registry.mutex};
+        registry.instances.erase(m_instance_id);
+    }
+    if(m_heap_fd == -1)
+    {
+        SlabDirectory &directory = slab_directory();
+        std::lock_guard<std::shared_mutex> lock{directory.mutex};
+        for(std::size_t i = 0; i < m_state->slab_list_top_idx; ++i)
+        {
+            directory.slabs.erase(m_state->slab_list[i]);
+        }
+    }
+
+    close_persistent();
+}
+
+std::unique_ptr<MyAlloc> MyAlloc::open_persistent(const std::string &path, std::uintptr_t base)
+{
+    return std::unique_ptr<MyAlloc>(new MyAlloc(path, base));
+}
+
+std::unique_ptr<MyAlloc> MyAlloc::create_shared_arena(std::uintptr_t base)
+{
+    int fd = memfd_create("bogomalloc-arena", MFD_CLOEXEC);
+    if(fd == -1)
+    {
+        throw std::runtime_error("Cannot create memfd for shared arena");
+    }
+    return std::unique_ptr<MyAlloc>(new MyAlloc(fd, base));
+}
+
+std::unique_ptr<MyAlloc> MyAlloc::attach_shared_arena(int fd)
+{
+    int own_fd = dup(fd);
+    if(own_fd == -1)
+    {
+        throw std::runtime_error("Cannot duplicate file descriptor of shared arena");
+    }
+    return std::unique_ptr<MyAlloc>(new MyAlloc(own_fd, 0));
+}
+
+void MyAlloc::HeapMutex::lock()
+{
+    if(m_shared == nullptr)
+    {
+        m_local.lock();
+        return;
+    }
+
+    int rc = pthread_mutex_lock(m_shared);
+    if(rc == EOWNERDEAD)
+    {
+        //The owner died while changing the heap, so free lists, trees and slab list may be half updated. Mark the arena as unusable,
+        //and unlock without pthread_mutex_consistent: that makes the mutex unrecoverable, so every later lock in any process fails as well.
+        *m_poisoned = 1;
+        pthread_mutex_unlock(m_shared);
+        throw std::runtime_error("Shared arena is corrupt: a process died while changing it");
+    }
+    if(rc == ENOTRECOVERABLE)
+    {
+        throw std::runtime_error("Shared arena is corrupt: a process died while changing it");
+    }
+    if(rc != 0)
+    {
+        throw std::runtime_error("Cannot lock shared arena");
+    }
+    if(*m_poisoned)
+    {
+        pthread_mutex_unlock(m_shared);
+        throw std::runtime_error("Shared arena is corrupt: a process died while changing it");
+    }
+}
+
+void MyAlloc::HeapMutex::unlock()
+{
+    if(m_shared == nullptr)
+    {
+        m_local.unlock();
+        return;
+    }
+    pthread_mutex_unlock(m_shared);
+}
+
+/*!
+ * \brief Opens or creates the heap file at path and maps it to base
+ * \param path
+ * \param base
+ */
+void MyAlloc::open_heap_file(const std::string &path, std::uintptr_t base)
+{
+    int fd = open(path.c_str(), O_RDWR | O_CREAT, 0600);
+    if(fd == -1)
+    {
+        throw std::runtime_error("Cannot open heap file " + path);
+    }
+
+    struct stat file_stat{};
+    if(fstat(fd, &file_stat) != 0 || (file_stat.st_size == 0 && ftruncate(fd, PERSISTENT_HEADER_REGION_SIZE) != 0))
+    {
+        close(fd);
+        throw std::runtime_error("Cannot size heap file " + path);
+    }
+
+    map_heap(fd, base, file_stat.st_size == 0, false, path);
+}
+
+/*!
+ * \brief Maps the heap in fd (a heap file or a memfd) to base, and either initializes a new heap in it or picks up the heap state from its root header.
+ * Takes ownership of fd, also if it throws.
+ * \param fd
+ * \param base
+ * \param is_new
+ * \param shared true for shared arenas: the heap is used by several processes at once, false for persistent heaps: the heap is used by one process at a time
+ * \param name for error messages
+ */
+void MyAlloc::map_heap(int fd, std::uintptr_t base, bool is_new, bool shared, const std::string &name)
+{
+    //Reserve the whole address range the heap can ever use, so that nothing else gets mapped where later slabs must go
+    void *reserved = mmap(reinterpret_cast<void*>(base), PERSISTENT_HEADER_REGION_SIZE + m_local_state.slab_list.size() * PERSISTENT_SLAB_STRIDE, PROT_NONE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+    if(reserved != reinterpret_cast<void*>(base))
+    {
+        if(reserved != MAP_FAILED)
+        {
+            munmap(reserved, PERSISTENT_HEADER_REGION_SIZE + m_local_state.slab_list.size() * PERSISTENT_SLAB_STRIDE);
+        }
+        close(fd);
+        throw std::runtime_error("Cannot reserve the address range of " + name);
+    }
+
+    m_heap_fd = fd;
+    m_heap_base = reinterpret_cast<BYTE*>(base);
+
+    //Pages of a mapping beyond the end of the file cannot be accessed
+    struct stat file_stat{};
+    if(fstat(m_heap_fd, &file_stat) != 0 || file_stat.st_size < static_cast<off_t>(PERSISTENT_HEADER_REGION_SIZE))
+    {
+        release_heap_file();
+        throw std::runtime_error("Heap file is truncated: " + name);
+    }
+
+    void *header = mmap(m_heap_base, PERSISTENT_HEADER_REGION_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, m_heap_fd, 0);
+    if(header == MAP_FAILED)
+    {
+        release_heap_file();
+        throw std::runtime_error("Cannot map the root header of " + name);
+    }
+    m_heap_header = reinterpret_cast<PersistentHeader*>(header);
+
+    if(is_new)
+    {
+        PersistentHeader *hdr = new(header) PersistentHeader{};
+        hdr->magic = PERSISTENT_MAGIC;
+        hdr->version = PERSISTENT_VERSION;
+        hdr->base = base;
+        hdr->header_size = sizeof(PersistentHeader);
+        hdr->min_block_size = MIN_BLOCK_SIZE;
+        hdr->large_block_min_order = LARGE_BLOCK_MIN_ORDER;
+        hdr->large_block_fit_policy = static_cast<std::uint64_t>(LARGE_BLOCK_FIT_POLICY);
+        hdr->clean = 0;
+    }
+    else
+    {
+        const PersistentHeader &hdr = *m_heap_header;
+        if(hdr.magic != PERSISTENT_MAGIC || hdr.version != PERSISTENT_VERSION || hdr.header_size != sizeof(PersistentHeader)
+                || hdr.min_block_size != MIN_BLOCK_SIZE || hdr.large_block_min_order != LARGE_BLOCK_MIN_ORDER
+                || hdr.large_block_fit_policy != static_cast<std::uint64_t>(LARGE_BLOCK_FIT_POLICY))
+        {
+            release_heap_file();
+            throw std::runtime_error("Not a heap of this allocator version: " + name);
+        }
+        if(hdr.base != base)
+        {
+            release_heap_file();
+            throw std::runtime_error("Heap was created for another base address: " + name);
+        }
+        if(shared && hdr.poisoned)
+        {
+            release_heap_file();
+            throw std::runtime_error("Shared arena is corrupt: a process died while changing it");
+        }
+        if(!shared && !hdr.clean)
+        {
+            release_heap_file();
+            throw std::runtime_error("Persistent heap was not closed consistently: " + name);
+        }
+        if(!slab_list_is_valid(hdr.state))
+        {
+            release_heap_file();
+            throw std::runtime_error("Corrupt slab list in heap: " + name);
+        }
+        //Mapping a slab past the end of the file would not fail, but read as zeros, i.e. as garbage block headers
+        for(std::size_t i = 0; i < hdr.state.slab_list_top_idx; ++i)
+        {
+            if(file_stat.st_size < hdr.state.slab_list[i] - m_heap_base + static_cast<off_t>(SLAB_SIZE))
+            {
+                release_heap_file();
+                throw std::runtime_error("Heap file is truncated: " + name);
+            }
+        }
+    }
+
+    m_state = &m_heap_header->state;
+
+    if(shared)
+    {
+        if(is_new)
+        {
+            pthread_mutexattr_t attr;
+            pthread_mutexattr_init(&attr);
+            pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+            pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+            pthread_mutex_init(&m_heap_header->mutex, &attr);
+            pthread_mutexattr_destroy(&attr);
+        }
+        m_mutex.share(&m_heap_header->mutex, &m_heap_header->poisoned);
+        m_shared_arena = true;
+
+        //Slabs of an existing arena are mapped by sync_shared_slabs under the lock, as other processes may be changing them right now
+        m_seen_slab_generation = m_state->slab_generation - 1;
+    }
+    else if(!is_new)
+    {
+        for(std::size_t i = 0; i < m_state->slab_list_top_idx; ++i)
+        {
+            if(map_heap_slab(m_state->slab_list[i], false) == MAP_FAILED)
+            {
+                release_heap_file();
+                throw std::runtime_error("Cannot map slab of " + name);
+            }
+        }
+
+        m_state->sweep_slab_idx = 0;
+        m_state->sweep_cursor = nullptr;
+        rebuild_free_index();
+
+        //From here on, the file no longer matches a consistent heap until close_persistent
+        m_heap_header->clean = 0;
+        msync(m_heap_header, PERSISTENT_HEADER_REGION_SIZE, MS_SYNC);
+    }
+
+    if(is_new && mm_init() == -1)
+    {
+        release_heap_file();
+        throw std::runtime_error("Cannot map the first slab of " + name);
+    }
+}
+
+/*!
+ * \brief Checks the slab list read from a heap file or shared arena before anything is mapped according to it: a file with a valid magic can still hold garbage,
+ * and mapping it with MAP_FIXED could replace any part of the process. Every slab must lie at one of the heap_slab_address positions, at most once, with the unused entries at the back.
+ * \param state
+ * \return
+ */
+bool MyAlloc::slab_list_is_valid(const HeapState &state) const
+{
+    if(state.slab_list_top_idx > state.slab_list.size())
+    {
+        return false;
+    }
+
+    const BYTE *first_slab = heap_slab_address(0);
+    const BYTE *last_slab = heap_slab_address(state.slab_list.size() - 1);
+    for(std::size_t i = 0; i < state.slab_list.size(); ++i)
+    {
+        BYTE *slab_ptr = state.slab_list[i];
+        if(i >= state.slab_list_top_idx)
+        {
+            if(slab_ptr != nullptr)
+            {
+                return false;
+            }
+            continue;
+        }
+
+        if(slab_ptr < first_slab || slab_ptr > last_slab || slab_ptr != heap_slab_address(heap_slab_position(slab_ptr)))
+        {
+            return false;
+        }
+        if(std::find(state.slab_list.begin(), state.slab_list.begin() + i, slab_ptr) != state.slab_list.begin() + i)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*!
+ * \brief Flushes a persistent heap to its file, marks it as consistent and unmaps it, or detaches from a shared arena.
+ * Afterwards the allocator holds no memory; pointers into the heap are invalid in this process. Does nothing for anonymous memory.
+ * \return 0 on success, -1 if the persistent heap could not be flushed (it then stays marked as not consistent)
+ */
+int MyAlloc::close_persistent()
+{
+    if(m_heap_fd == -1)
+    {
+        return 0;
+    }
+
+    stop_background_trim();
+
+    int retval = 0;
+    if(!m_shared_arena)
+    {
+        std::lock_guard<HeapMutex> lock{m_mutex};
+
+        //Data first, then the clean flag, so that a crash in between leaves the heap marked as not consistent
+        for(std::size_t i = 0; i < m_state->slab_list_top_idx; ++i)
+        {
+            if(msync(m_state->slab_list.at(i), SLAB_SIZE, MS_SYNC) != 0)
+            {
+                retval = -1;
+            }
+        }
+        if(retval == 0 && msync(m_heap_header, PERSISTENT_HEADER_REGION_SIZE, MS_SYNC) == 0)
+        {
+            m_heap_header->clean = 1;
+            if(msync(m_heap_header, PERSISTENT_HEADER_REGION_SIZE, MS_SYNC) != 0)
+            {
+                retval = -1;
+            }
+        }
+        else
+        {
+            retval = -1;
+        }
+    }
+
+    //The shared mutex lives in the header that is about to be unmapped
+    m_mutex.share(nullptr, nullptr);
+    release_heap_file();
+
+    m_state = &m_local_state;
+    m_local_state = HeapState{};
+    m_free_index = {};
+    m_shared_arena = false;
+    m_closed = true;
+
+    return retval;
+}
+
+/*!
+ * \brief Unmaps the whole address range of a persistent heap or shared arena and closes its file
+ */
+void MyAlloc::release_heap_file()
+{
+    munmap(m_heap_base, PERSISTENT_HEADER_REGION_SIZE + m_local_state.slab_list.size() * PERSISTENT_SLAB_STRIDE);
+    close(m_heap_fd);
+    m_heap_fd = -1;
+    m_heap_base = nullptr;
+    m_heap_header = nullptr;
+    m_slab_mapped.fill(false);
+}
+
+/*!
+ * \brief Maps the part of the heap file that belongs to the slab at slab_ptr
+ * \param slab_ptr must be one of the heap_slab_address positions
+ * \param grow true for a new slab: the file is grown if necessary. Otherwise, the slab must already be in the file.
+ * \return slab_ptr, or MAP_FAILED
+ */
+void* MyAlloc::map_heap_slab(BYTE *slab_ptr, bool grow)
+{
+    const off_t offset = slab_ptr - m_heap_base;
+    assert(slab_ptr == heap_slab_address(heap_slab_position(slab_ptr)));
+
+    struct stat file_stat{};
+    if(fstat(m_heap_fd, &file_stat) != 0)
+    {
+        return MAP_FAILED;
+    }
+    if(file_stat.st_size < static_cast<off_t>(offset + SLAB_SIZE) && (!grow || ftruncate(m_heap_fd, offset + SLAB_SIZE) != 0))
+    {
+        return MAP_FAILED;
+    }
+
+    void *retval = mmap(slab_ptr, SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, m_heap_fd, offset);
+    if(retval != MAP_FAILED)
+    {
+        m_slab_mapped.at(heap_slab_position(slab_ptr)) = true;
+    }
+    return retval;
+}
+
+/*!
+ * \brief Maps the slabs other processes added to a shared arena and drops those they removed. Must be called with m_mutex held before the heap is touched.
+ */
+void MyAlloc::sync_shared_slabs()
+{
+    if(!m_shared_arena || m_seen_slab_generation == m_state->slab_generation)
+    {
+        return;
+    }
+    if(!slab_list_is_valid(*m_state))
+    {
+        throw std::runtime_error("Corrupt slab list in shared arena");
+    }
+
+    auto slabs_begin = m_state->slab_list.begin();
+    auto slabs_end = m_state->slab_list.begin() + m_state->slab_list_top_idx;
+    for(std::size_t pos = 0; pos < m_slab_mapped.size(); ++pos)
+    {
+        BYTE *slab_ptr = heap_slab_address(pos);
+        bool in_use = std::find(slabs_begin, slabs_end, slab_ptr) != slabs_end;
+
+        if(in_use && !m_slab_mapped.at(pos))
+        {
+            if(map_heap_slab(slab_ptr, false) == MAP_FAILED)
+            {
+                throw std::runtime_error("Cannot map slab of shared arena");
+            }
+        }
+        else if(!in_use && m_slab_mapped.at(pos))
+        {
+            if(mmap(slab_ptr, SLAB_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED)
+            {
+                throw std::runtime_error("Munmap error!");
+            }
+            m_slab_mapped.at(pos) = false;
+        }
+    }
+    m_seen_slab_generation = m_state->slab_generation;
+}
+
+/*!
+ * \brief Sets the root object name of a persistent heap or shared arena to ptr, which must point into the heap. ptr == nullptr removes the root.
+ * Roots are the entry points to the data in the heap for other processes. Throws if the heap is not persistent or shared, the name is too long or all roots are in use.
+ * \param name
+ * \param ptr
+ */
+void MyAlloc::set_root(std::string_view name, void *ptr)
+{
+    std::lock_guard<HeapMutex> lock{m_mutex};
+
+    if(m_heap_header == nullptr)
+    {
+        throw std::runtime_error("Root objects exist only in persistent heaps and shared arenas");
+    }
+    if(name.empty() || name.size() >= PERSISTENT_ROOT_NAME_SIZE)
+    {
+        throw std::runtime_error("Invalid root object name");
+    }
+
+    PersistentRoot *free_entry = nullptr;
+    for(PersistentRoot &root : m_heap_header->roots)
+    {
+        if(name == root.name.data())
+        {
+            root.ptr = reinterpret_cast<BYTE*>(ptr);
+            if(ptr == nullptr)
+            {
+                root.name.fill('\0');
+            }
+            return;
+        }
+        if(free_entry == nullptr && root.name.front() == '\0')
+        {
+            free_entry = &root;
+        }
+    }
+
+    if(ptr == nullptr)
+    {
+        return;
+    }
+    if(free_entry == nullptr)
+    {
+        throw std::runtime_error("All root objects of the heap are in use");
+    }
+
+    free_entry->name.fill('\0');
+    std::memcpy(free_entry->name.data(), name.data(), name.size());
+    free_entry->ptr = reinterpret_cast<BYTE*>(ptr);
+}
+
+/*!
+ * \brief Returns the root object name of a persistent heap or shared arena, or nullptr if there is none
+ * \param name
+ * \return
+ */
+void* MyAlloc::get_root(std::string_view name)
+{
+    std::lock_guard<HeapMutex> lock{m_mutex};
+    sync_shared_slabs();
+
+    if(m_heap_header == nullptr)
+    {
+        throw std::runtime_error("Root objects exist only in persistent heaps and shared arenas");
+    }
+
+    for(const PersistentRoot &root : m_heap_header->roots)
+    {
+        if(root.name.front() != '\0' && name == root.name.data())
+        {
+            return root.ptr;
+        }
+    }
+    return nullptr;
+}
+
+void* MyAlloc::from_offset(std::uintptr_t offset)
+{
+    assert(m_heap_base != nullptr);
+    std::lock_guard<HeapMutex> lock{m_mutex};
+    sync_shared_slabs();
+    return m_heap_base + offset;
+}
+
+/*!
+ * \brief Refills the free block index from the free lists. The index lives in ordinary memory, so it is not part of a persistent heap.
+ */
+void MyAlloc::rebuild_free_index()
+{
+    for(std::size_t idx = 0; idx < m_state->free_lists.size(); ++idx)
+    {
+        m_free_index.at(idx) = {};
+        if(uses_free_index(idx))
+        {
+            for(BYTE *bp = m_state->free_lists.at(idx); bp != nullptr; bp = NEXT_BLKP(bp))
+            {
+                index_insert(bp);
+            }
+        }
+    }
+}
+
 /*!
  * \brief allocate one block of max_block_size and additional boundary blocks left and right
  * \return
@@ -28,7 +786,7 @@ int MyAlloc::mm_init()
 int MyAlloc::mm_request_more_memory()
 {
     //Cannot fit more slabs into the slab list
-    if(m_slab_list_top_idx == m_slab_list.size())
+    if(m_state->slab_list_top_idx == m_state->slab_list.size())
     {
         return -1;
     }
@@ -39,26 +797,30 @@ int MyAlloc::mm_request_more_memory()
         return -1;
 
     //Put newly mapped memory on top of list of slabs
-    m_slab_list.at(m_slab_list_top_idx) = new_mem_ptr;
-    ++m_slab_list_top_idx;
+    m_state->slab_list.at(m_state->slab_list_top_idx) = new_mem_ptr;
+    ++m_state->slab_list_top_idx;
+    m_seen_slab_generation = ++m_state->slab_generation;
+
+    if(m_heap_fd == -1)
+    {
+        SlabDirectory &directory = slab_directory();
+        std::lock_guard<std::shared_mutex> lock{directory.mutex};
+        directory.slabs.emplace(new_mem_ptr, this);
+    }
 
     //put boundary blocks left and right of free space
     PUT_WORD(new_mem_ptr, 0); //Alignment padding for header,footer,and epilogue blocks ----- This assumes that header and footer are 1 WORD in size!
-    PUT_WORD(new_mem_ptr + WSIZE, PACK(OVERHEAD_SIZE, 1)); //left boundary header
+    PUT_WORD(new_mem_ptr + WSIZE, PACK(MIN_BLOCK_SIZE, 1)); //left boundary header
     PUT_ADDRESS(new_mem_ptr + WSIZE + HEADERSIZE, nullptr); //Address of nonexistant next block for prologue block
     PUT_ADDRESS(new_mem_ptr + WSIZE + HEADERSIZE + SIZE_OF_ADDRESS, nullptr); //Address of nonexistant previous block for prologue block
-    PUT_WORD(new_mem_ptr + WSIZE + HEADERSIZE + 2 * SIZE_OF_ADDRESS, PACK(OVERHEAD_SIZE, 1)); //left boundary footer
+    PUT_WORD(new_mem_ptr + WSIZE + MIN_BLOCK_SIZE - FOOTERSIZE, PACK(MIN_BLOCK_SIZE, 1)); //left boundary footer
     PUT_WORD(new_mem_ptr + SLAB_SIZE - HEADERSIZE, PACK(0,1)); //Epilogue header
 
 
     constexpr std::size_t remaining_free_block_size = MAX_BLOCK_SIZE;
 
-    BYTE* prevtop = m_free_lists.at(blocksize_to_freelist_idx(remaining_free_block_size));
-
     //Create one large free block out of the rest of the memory. so starting from Fourth block to the second-to-last block
     PUT_WORD(new_mem_ptr + LEFT_BOUNDARY_SIZE, PACK(remaining_free_block_size, 0)); //block header
-    PUT_ADDRESS(new_mem_ptr + LEFT_BOUNDARY_SIZE + HEADERSIZE, prevtop); //address of nonexistant next block
-    PUT_ADDRESS(new_mem_ptr + LEFT_BOUNDARY_SIZE + HEADERSIZE + SIZE_OF_ADDRESS, nullptr); //address of nonexistant previous block
     PUT_WORD(new_mem_ptr + SLAB_SIZE - HEADERSIZE - FOOTERSIZE, PACK(remaining_free_block_size, 0)); //block footer
 
     //insert the aforementioned large free block into the largest size class of the free list array
@@ -67,12 +829,7 @@ int MyAlloc::mm_request_more_memory()
     assert(HDRP(newtop) == new_mem_ptr + LEFT_BOUNDARY_SIZE);
     assert (!GET_ALLOC(HDRP(newtop)));
 
-    if(NEXT_BLKP(newtop) != nullptr)
-    {
-        PUT_ADDRESS(HDRP(NEXT_BLKP(newtop)) + HEADERSIZE + SIZE_OF_ADDRESS, newtop); //Put new block as previous for potentially existing block
-    }
-
-    m_free_lists.at(blocksize_to_freelist_idx(remaining_free_block_size)) = newtop;
+    insert_into_freelist(newtop);
 
     return 0;
 }
@@ -85,10 +842,69 @@ int MyAlloc::mm_request_more_memory()
  */
 void* MyAlloc::mem_map_slab()
 {
+    if(m_heap_fd != -1)
+    {
+        //Persistent heap or shared arena: take the first slab position in the reserved range that is not in use
+        for(std::size_t pos = 0; pos < m_state->slab_list.size(); ++pos)
+        {
+            BYTE *slab_ptr = heap_slab_address(pos);
+            if(std::find(m_state->slab_list.begin(), m_state->slab_list.begin() + m_state->slab_list_top_idx, slab_ptr) == m_state->slab_list.begin() + m_state->slab_list_top_idx)
+            {
+                return map_heap_slab(slab_ptr, true);
+            }
+        }
+        return MAP_FAILED;
+    }
+
     void *retval = mmap(NULL, SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, 0, 0);
+    if(retval != MAP_FAILED && m_numa_node != NO_NUMA_NODE)
+    {
+        bind_slab_to_numa_node(retval);
+    }
     return retval;
 }
 
+/*!
+ * \brief Sets the memory policy of a freshly mapped slab, before any of its pages are touched, so that they are allocated on m_numa_node.
+ * MPOL_PREFERRED rather than MPOL_BIND: when the node runs out of memory, remote pages are better than failing page faults. Errors are ignored, the slab then stays unplaced.
+ * \param slab_ptr
+ */
+void MyAlloc::bind_slab_to_numa_node(void *slab_ptr) const
+{
+    constexpr std::size_t BITS_PER_MASK_WORD = sizeof(unsigned long) * 8;
+
+    std::vector<unsigned long> nodemask(m_numa_node / BITS_PER_MASK_WORD + 1, 0);
+    nodemask.at(m_numa_node / BITS_PER_MASK_WORD) = 1UL << (m_numa_node % BITS_PER_MASK_WORD);
+
+    //The kernel reads maxnode - 1 bits of the mask
+    syscall(SYS_mbind, slab_ptr, SLAB_SIZE, MPOL_PREFERRED, nodemask.data(), nodemask.size() * BITS_PER_MASK_WORD + 1, 0);
+}
+
+/*!
+ * \brief Unmaps a slab. In a persistent heap, the slab's pages in the file are released and the address range goes back to being reserved.
+ * \param start_of_slab
+ */
+void MyAlloc::mem_unmap_slab(void *start_of_slab)
+{
+    if(m_heap_fd == -1)
+    {
+        if(munmap(start_of_slab, SLAB_SIZE) != 0)
+        {
+            throw std::runtime_error("Munmap error!");
+        }
+        return;
+    }
+
+    //Punching the hole is only an optimization, the slab is unused either way
+    fallocate(m_heap_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, reinterpret_cast<BYTE*>(start_of_slab) - m_heap_base, SLAB_SIZE);
+
+    if(mmap(start_of_slab, SLAB_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED)
+    {
+        throw std::runtime_error("Munmap error!");
+    }
+    m_slab_mapped.at(heap_slab_position(reinterpret_cast<BYTE*>(start_of_slab))) = false;
+}
+
 /*!
     * \brief finds a fitting block with a free payload size of at least asize - might be more.
     * \param asize
@@ -105,16 +921,21 @@ void *MyAlloc::find_fit(std::size_t asize)
     BYTE *ret = nullptr;
 
     //First: Check freelist that had the last free block added. In most cases this could have a block of enough size
-    ret = find_fit_in_list(m_free_lists.at(m_last_freed_idx), asize);
+    //Not for large blocks searched by best fit, as any fit found there might not be the best one
+    if(!uses_large_block_tree(blocksize_to_freelist_idx(asize)))
+    {
+        ret = find_fit_in_class(m_state->last_freed_idx, asize);
+    }
 
     //go through freelists and check:s
     //1. if the size class of that list is large enough
+    //Since the size classes are searched in ascending order, the first best fit found in a tree is also the best fit overall
     if(ret == nullptr)
     {
-        for(std::size_t i = blocksize_to_freelist_idx(asize); i < m_free_lists.size(); ++i)
+        for(std::size_t i = blocksize_to_freelist_idx(asize); i < m_state->free_lists.size(); ++i)
         {
             //2. go through that list if the size class and see if a fit can be found in that specific explicit free list
-            ret = find_fit_in_list(m_free_lists.at(i), asize);
+            ret = find_fit_in_class(i, asize);
             if(ret != nullptr)
             {
                 return ret;
@@ -125,27 +946,158 @@ void *MyAlloc::find_fit(std::size_t asize)
 }
 
 /*!
- * \brief Finds the first fit in the explicit free list given by ptr that can contain a block of asize (including overhead). Returns the block pointer, NOT the headerpointer!
- * \param ptr
- * \param asize
- * \return
+ * \brief Finds a free block of at least asize (including overhead) in the size class idx, using the free block index if it is enabled
+ * \param idx
+ * \param asize
+ * \return block pointer or nullptr
+ */
+BYTE* MyAlloc::find_fit_in_class(std::size_t idx, std::size_t asize)
+{
+    if(uses_large_block_tree(idx))
+    {
+        return find_best_fit_in_tree(idx, asize);
+    }
+
+    if(uses_free_index(idx))
+    {
+        return find_fit_in_index(idx, asize);
+    }
+    return find_fit_in_list(m_state->free_lists.at(idx), asize);
+}
+
+/*!
+ * \brief Finds the first fit in the explicit free list given by ptr that can contain a block of asize (including overhead). Returns the block pointer, NOT the headerpointer!
+ * \param ptr
+ * \param asize
+ * \return
+ */
+BYTE* MyAlloc::find_fit_in_list(BYTE* ptr, std::size_t asize)
+{
+    BYTE *currAddr = ptr;
+    BYTE *ret = nullptr;
+    while(currAddr != nullptr && GET_SIZE(HDRP(currAddr)) > 0) //size == 0 means next "block" is Epilogue block
+    {
+        std::size_t currSize = GET_SIZE(HDRP(currAddr));
+        WORD currAlloc = GET_ALLOC(HDRP(currAddr));
+        if(currSize >= asize && !currAlloc)
+        {
+            ret = currAddr;
+            return ret;
+        }
+        currAddr = NEXT_BLKP(currAddr);
+    }
+    return ret;
+}
+
+/*!
+ * \brief Returns the position of the first entry in sizes[0, count) that is >= asize, or count if there is none.
+ * \param sizes
+ * \param count
+ * \param asize must be > 0
+ * \return
+ */
+static std::size_t first_size_at_least(const WORD *sizes, std::size_t count, std::size_t asize)
+{
+    std::size_t i = 0;
+
+#if defined(__SSE2__)
+    //SSE2 only has signed compares: flip the sign bit of both sides, then size >= asize becomes size > asize - 1
+    const __m128i bias = _mm_set1_epi32(static_cast<int>(0x80000000u));
+    const __m128i key = _mm_xor_si128(_mm_set1_epi32(static_cast<int>(asize - 1)), bias);
+    for(; i + 4 <= count; i += 4)
+    {
+        __m128i vals = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(sizes + i)), bias);
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(vals, key)));
+        if(mask != 0)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+
+    for(; i < count; ++i)
+    {
+        if(sizes[i] >= asize)
+        {
+            return i;
+        }
+    }
+    return count;
+}
+
+/*!
+ * \brief Finds the first block in the free block index of size class idx that can contain a block of asize (including overhead).
+ * Only the packed size array is scanned, so no block header is touched until a fit is found. Returns the block pointer, NOT the headerpointer!
+ * \param idx
+ * \param asize
+ * \return
+ */
+BYTE* MyAlloc::find_fit_in_index(std::size_t idx, std::size_t asize)
+{
+    const FreeBlockIndex &index = m_free_index.at(idx);
+
+    std::size_t pos = first_size_at_least(index.sizes.data(), index.sizes.size(), asize);
+    if(pos == index.sizes.size())
+    {
+        return nullptr;
+    }
+
+    BYTE *ret = index.blocks[pos];
+    assert(!GET_ALLOC(HDRP(ret)) && GET_SIZE(HDRP(ret)) == index.sizes[pos]);
+    return ret;
+}
+
+/*!
+ * \brief Finds the smallest block in the tree of the large size class idx that can contain a block of asize (including overhead).
+ * Of several equally large blocks, the one with the lowest address is chosen. Returns the block pointer, NOT the headerpointer!
+ * \param idx
+ * \param asize
+ * \return
+ */
+BYTE* MyAlloc::find_best_fit_in_tree(std::size_t idx, std::size_t asize)
+{
+    FreeBlockTreeNode *node = m_state->large_block_trees.at(idx - LARGE_BLOCK_MIN_ORDER).best_fit(asize);
+    if(node == nullptr)
+    {
+        return nullptr;
+    }
+
+    BYTE *ret = TREE_NODE_TO_BLKP(node);
+    assert(!GET_ALLOC(HDRP(ret)) && GET_SIZE(HDRP(ret)) == node->size);
+    return ret;
+}
+
+/*!
+ * \brief Appends the free block bptr to the free block index of its size class and remembers its position inside the block
+ * \param bptr
+ */
+void MyAlloc::index_insert(BYTE* bptr)
+{
+    FreeBlockIndex &index = m_free_index.at(blocksize_to_freelist_idx(GET_SIZE(HDRP(bptr))));
+
+    PUT_INDEX_SLOT(bptr, index.blocks.size());
+    index.sizes.push_back(GET_SIZE(HDRP(bptr)));
+    index.blocks.push_back(bptr);
+}
+
+/*!
+ * \brief Removes the free block bptr from the free block index of its size class by moving the last entry into its slot
+ * \param bptr
  */
-BYTE* MyAlloc::find_fit_in_list(BYTE* ptr, std::size_t asize)
+void MyAlloc::index_remove(BYTE* bptr)
 {
-    BYTE *currAddr = ptr;
-    BYTE *ret = nullptr;
-    while(currAddr != nullptr && GET_SIZE(HDRP(currAddr)) > 0) //size == 0 means next "block" is Epilogue block
-    {
-        std::size_t currSize = GET_SIZE(HDRP(currAddr));
-        WORD currAlloc = GET_ALLOC(HDRP(currAddr));
-        if(currSize >= asize && !currAlloc)
-        {
-            ret = currAddr;
-            return ret;
-        }
-        currAddr = NEXT_BLKP(currAddr);
-    }
-    return ret;
+    FreeBlockIndex &index = m_free_index.at(blocksize_to_freelist_idx(GET_SIZE(HDRP(bptr))));
+
+    std::size_t slot = GET_INDEX_SLOT(bptr);
+    assert(slot < index.blocks.size() && index.blocks[slot] == bptr);
+
+    BYTE *moved = index.blocks.back();
+    index.blocks[slot] = moved;
+    index.sizes[slot] = index.sizes.back();
+    PUT_INDEX_SLOT(moved, slot);
+
+    index.blocks.pop_back();
+    index.sizes.pop_back();
 }
 
 /*!
@@ -194,22 +1146,14 @@ void MyAlloc::place(void *const bp, std::size_t asize)
         //Split off free block to the right
         //BYTE* splitblockp = reinterpret_cast<BYTE*>(HDRP(bp) + GET_SIZE(HDRP(bp)) + HEADERSIZE);
         BYTE *splitblockp = NEXT_BLKP_IMPL(bp);
-        BYTE* prevtop_b = m_free_lists.at(blocksize_to_freelist_idx(bsize));
         PUT_WORD(HDRP(splitblockp), PACK(bsize,0)); //Header of split block
-        PUT_ADDRESS(HDRP(splitblockp) + HEADERSIZE, prevtop_b); //next Address block of split block
-        PUT_ADDRESS(HDRP(splitblockp) + HEADERSIZE + SIZE_OF_ADDRESS, nullptr); //address of nonexistant previous block
         PUT_WORD(FTRP(splitblockp), PACK(bsize, 0)); //Footer of split block
 
 
         assert(NEXT_BLKP_IMPL(bp) ==  splitblockp && GET_SIZE(FTRP(splitblockp)) == GET_SIZE(HDRP(splitblockp)));
 
-        if(prevtop_b != nullptr)
-        {
-            PUT_ADDRESS(HDRP(prevtop_b) + HEADERSIZE + SIZE_OF_ADDRESS, splitblockp); //Put new split block as previous for potentially existing block
-        }
-
         //insert new free split-block into correct explicit free list
-        m_free_lists.at(blocksize_to_freelist_idx(bsize)) = reinterpret_cast<BYTE*> (splitblockp);
+        insert_into_freelist(splitblockp);
     }
     else
     {
@@ -220,61 +1164,113 @@ void MyAlloc::place(void *const bp, std::size_t asize)
 }
 
 /*!
- * \brief MyAlloc::malloc
- * \param size
+ * \brief Allocation path for requests the thread cache could not serve
+ * \param asize
+ * \param idx
+ * \return
+ */
+void* MyAlloc::malloc_locked(std::size_t asize, std::size_t idx)
+{
+    throw_if_closed();
+    assert(asize % DSIZE == 0 && idx == blocksize_to_freelist_idx(asize));
+
+    std::lock_guard<HeapMutex> lock{m_mutex};
+    sync_shared_slabs();
+    ++m_malloc_calls;
+
+    //Fast path: the most recently freed block of the request's own size class fits often enough, e.g. when a loop frees and allocates blocks of the same size
+    //Not for large blocks searched by best fit, as that block might not be the best fit
+    if(!uses_large_block_tree(idx))
+    {
+        BYTE *head = m_state->free_lists[idx];
+        if(head != nullptr && GET_SIZE(HDRP(head)) >= asize)
+        {
+            place(head, asize);
+            return head;
+        }
+    }
+
+    return malloc_slow(asize);
+}
+
+/*!
+ * \brief Allocation path when the fast path found nothing: search all free lists, then coalesce, then map a new slab. m_mutex must be held.
+ * \param asize
  * \return
  */
-void* MyAlloc::malloc(std::size_t size)
+void* MyAlloc::malloc_slow(std::size_t asize)
 {
     //find fit (using find_fit, duh) and create block out of found block (split beforehand inside place function)
     //also remove the block from the free list after allocating it
     //If no fit can be found, allocate a new memory slab and put that new block on the free list
 
-    /* Ignore spurious requests */
-    if(size == 0 || size > MAX_BLOCK_SIZE)
-        return nullptr;
-
     void *retp = nullptr;
 
-    /* Adjust block size to include overhead and DWORD alignment requirements */
-    std::size_t asize = align_size_to_DWORD(OVERHEAD_SIZE + size);
-
-
     /*Search the free lists for a fit */
     retp = find_fit(asize);
 
     if(retp == nullptr)
     {
         m_coalesce_flag = true;
-    }
 
-    if(retp != nullptr)
-    {
-        place(retp, asize);
-        return retp;
+        //Adjacent free blocks that were never coalesced might together be large enough: merge some before mapping a new slab
+        //A slab that turns out to be completely free is kept: if the request does not fit anyway, a new slab would be mapped right after unmapping it
+        coalesce_sweep(SWEEP_BUDGET_ON_ALLOC_FAILURE, false);
+        retp = find_fit(asize);
     }
 
-    //handle getting more memory in case no fit was found
-    if(mm_request_more_memory() == -1)
+    if(retp == nullptr)
     {
-        return nullptr;
-    }
-    //try again if memory could be requested
-    retp = malloc(size);
+        //handle getting more memory in case no fit was found
+        if(mm_request_more_memory() == -1)
+        {
+            return nullptr;
+        }
+        //try again if memory could be requested
+        retp = find_fit(asize);
 
-    //At this point this should not be possible; request was reasonable and we got a full new slab
-    assert(retp != nullptr);
+        //At this point this should not be possible; request was reasonable and we got a full new slab
+        assert(retp != nullptr);
+        if(retp == nullptr)
+        {
+            return nullptr;
+        }
+    }
 
+    place(retp, asize);
     return retp;
 }
 
 /*!
- * \brief free block and coalesce as far as possible by checking repeatedly to the left and right for free blocks: then place in appropiate size class in free list
+ * \brief free block and coalesce as far as possible by checking repeatedly to the left and right for free blocks: then place in appropiate size class in free list. Bypasses the thread cache.
  * \param ptr
  */
-void MyAlloc::free(void *bp)
+void MyAlloc::free_to_heap(void *bp)
+{
+    throw_if_closed();
+    std::lock_guard<HeapMutex> lock{m_mutex};
+    sync_shared_slabs();
+    free_block(bp);
+}
+
+/*!
+ * \brief Returns the number of mapped slabs and of malloc and free calls so far
+ * \return
+ */
+MyAlloc::Stats MyAlloc::stats()
+{
+    std::lock_guard<HeapMutex> lock{m_mutex};
+    return Stats{m_state->slab_list_top_idx, m_state->slab_list_top_idx * SLAB_SIZE, m_malloc_calls, m_free_calls};
+}
+
+/*!
+ * \brief Does the work of free. m_mutex must be held.
+ * \param bp
+ */
+void MyAlloc::free_block(void *bp)
 {
     assert(GET_SIZE(HDRP(bp)) == GET_SIZE(FTRP(bp)));
+    ++m_free_calls;
 
     //set header and footer to size of block and alloc bit set to 0:
     std::size_t size = GET_SIZE(HDRP(bp));
@@ -291,18 +1287,9 @@ void MyAlloc::free(void *bp)
     assert(GET_SIZE(HDRP(bp)) == GET_SIZE(FTRP(bp)));
 
     //insert newly-freed block into correct explicit free list, and insert correct address block into freed block
-    BYTE* prevtop = m_free_lists.at(blocksize_to_freelist_idx(GET_SIZE(HDRP(bp))));
-    PUT_ADDRESS(HDRP(bp) + HEADERSIZE, prevtop); //address of potentially nonenxistant next block
-    PUT_ADDRESS(HDRP(bp) + HEADERSIZE + SIZE_OF_ADDRESS, prevtop); //address of potentially nonenxistant next block
-
-    if(prevtop != nullptr)
-    {
-        PUT_ADDRESS(HDRP(prevtop) + HEADERSIZE + SIZE_OF_ADDRESS, bp); //Put new free block as previous for potentially existing block
-    }
+    insert_into_freelist(reinterpret_cast<BYTE*>(bp));
 
-    m_free_lists.at(blocksize_to_freelist_idx(GET_SIZE(HDRP(bp)))) = reinterpret_cast<BYTE*>(bp);
-
-    m_last_freed_idx = blocksize_to_freelist_idx(GET_SIZE(HDRP(bp)));
+    m_state->last_freed_idx = blocksize_to_freelist_idx(GET_SIZE(HDRP(bp)));
 
     ++total_frees;
     ++consecutive_frees;
@@ -355,6 +1342,7 @@ void* MyAlloc::coalesce(void *bp)
             PUT_WORD(FTRP(bp), PACK(size, 0));
 
             assert(GET_SIZE(HDRP(bp)) == GET_SIZE(FTRP(bp)));
+            fix_sweep_cursor(reinterpret_cast<BYTE*>(bp));
         }
 
         else if (!prev_alloc && next_alloc) //case 3, left block coalesced
@@ -370,6 +1358,7 @@ void* MyAlloc::coalesce(void *bp)
             PUT_WORD(FTRP(bp), PACK(size, 0));
 
             assert(GET_SIZE(HDRP(bp)) == GET_SIZE(FTRP(bp)));
+            fix_sweep_cursor(reinterpret_cast<BYTE*>(bp));
         }
 
         else //case 4
@@ -387,12 +1376,182 @@ void* MyAlloc::coalesce(void *bp)
             PUT_WORD(FTRP(bp), PACK(size, 0));
 
             assert(GET_SIZE(HDRP(bp)) == GET_SIZE(FTRP(bp)));
-
+            fix_sweep_cursor(reinterpret_cast<BYTE*>(bp));
         }
     }
     return bp;
 }
 
+/*!
+ * \brief Walks the physical block chain of the slabs, starting where the previous call stopped, and merges every run of adjacent free blocks into one.
+ * If unmap_unused is set, a slab whose blocks have all been merged into one free block is unmapped when the sweep leaves it.
+ * At most budget blocks are looked at or merged, so the latency of one call is bounded.
+ * \param budget
+ * \param unmap_unused
+ * \return true if the sweep went past the last slab and will start over with the first one on the next call
+ */
+bool MyAlloc::coalesce_sweep(std::size_t budget, bool unmap_unused)
+{
+    std::size_t work = 0;
+    while(work < budget)
+    {
+        if(m_state->sweep_slab_idx >= m_state->slab_list_top_idx)
+        {
+            m_state->sweep_slab_idx = 0;
+            m_state->sweep_cursor = nullptr;
+            return true;
+        }
+
+        BYTE *slab = m_state->slab_list.at(m_state->sweep_slab_idx);
+        if(m_state->sweep_cursor == nullptr)
+        {
+            m_state->sweep_cursor = slab + LEFT_BOUNDARY_SIZE + HEADERSIZE;
+        }
+
+        //Block pointer of the epilogue block: end of this slab
+        if(m_state->sweep_cursor == slab + SLAB_SIZE)
+        {
+            m_state->sweep_cursor = nullptr;
+            if(!unmap_unused || !unmap_slab_if_unused(slab))
+            {
+                ++m_state->sweep_slab_idx;
+            }
+            //If the slab was unmapped, the next slab has moved into its place in the slab list
+            continue;
+        }
+
+        BYTE *bp = m_state->sweep_cursor;
+        BYTE *right_block = NEXT_BLKP_IMPL(bp);
+        ++work;
+
+        //The epilogue is marked allocated, so this never merges past the end of the slab
+        if(!GET_ALLOC(HDRP(bp)) && !GET_ALLOC(HDRP(right_block)))
+        {
+            //Merge the right block into bp and stay on bp, there might be more free blocks to its right
+            remove_from_freelist(bp);
+            remove_from_freelist(right_block);
+
+            std::size_t size = GET_SIZE(HDRP(bp)) + GET_SIZE(HDRP(right_block));
+            PUT_WORD(HDRP(bp), PACK(size, 0));
+            PUT_WORD(FTRP(bp), PACK(size, 0));
+
+            insert_into_freelist(bp);
+            continue;
+        }
+
+        m_state->sweep_cursor = right_block;
+    }
+    return false;
+}
+
+/*!
+ * \brief Must be called whenever blocks were merged into merged_bp outside of the sweep: if the sweep cursor pointed to a block that no longer exists, it is moved to the start of the merged block
+ * \param merged_bp
+ */
+void MyAlloc::fix_sweep_cursor(BYTE *merged_bp)
+{
+    if(m_state->sweep_cursor > merged_bp && m_state->sweep_cursor < NEXT_BLKP_IMPL(merged_bp))
+    {
+        m_state->sweep_cursor = merged_bp;
+    }
+}
+
+/*!
+ * \brief Runs the incremental coalescing sweep for at most budget blocks. With budget SIZE_MAX, the sweep starts over at the first slab, so that it covers the whole heap.
+ * \param budget
+ * \return true if the sweep has passed the last slab
+ */
+bool MyAlloc::trim(std::size_t budget)
+{
+    throw_if_closed();
+    //Blocks in thread caches are allocated as far as the heap is concerned, and would keep their slabs mapped
+    drain_thread_caches();
+
+    std::lock_guard<HeapMutex> lock{m_mutex};
+    sync_shared_slabs();
+
+    //Resuming where an earlier budgeted call stopped would skip the slabs before that point, although blocks there may have been freed since
+    if(budget == SIZE_MAX)
+    {
+        m_state->sweep_slab_idx = 0;
+        m_state->sweep_cursor = nullptr;
+    }
+    return coalesce_sweep(budget, true);
+}
+
+/*!
+ * \brief Starts a thread that runs the coalescing sweep for at most budget blocks every interval. Does nothing if it is already running.
+ * \param interval
+ * \param budget
+ */
+void MyAlloc::start_background_trim(std::chrono::milliseconds interval, std::size_t budget)
+{
+    std::lock_guard<std::mutex> lock{m_trim_mutex};
+    drop_inherited_trim();
+    if(m_trim)
+    {
+        return;
+    }
+
+    m_trim = std::make_unique<BackgroundTrim>();
+    m_trim->pid = getpid();
+    BackgroundTrim *trim_state = m_trim.get();
+    m_trim->thread = std::thread([this, trim_state, interval, budget]
+    {
+        std::unique_lock<std::mutex> lock{trim_state->mutex};
+        while(!trim_state->cv.wait_for(lock, interval, [trim_state]{ return trim_state->stop; }))
+        {
+            lock.unlock();
+            try
+            {
+                trim(budget);
+            }
+            catch(const std::runtime_error&)
+            {
+                //Heap closed or shared arena corrupt: nothing left to trim
+                return;
+            }
+            lock.lock();
+        }
+    });
+}
+
+/*!
+ * \brief Stops the background trim thread and waits for it to finish
+ */
+void MyAlloc::stop_background_trim()
+{
+    std::unique_ptr<BackgroundTrim> trim_state;
+    {
+        std::lock_guard<std::mutex> lock{m_trim_mutex};
+        drop_inherited_trim();
+        trim_state = std::move(m_trim);
+    }
+    if(!trim_state)
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock{trim_state->mutex};
+        trim_state->stop = true;
+    }
+    trim_state->cv.notify_one();
+    trim_state->thread.join();
+}
+
+/*!
+ * \brief In a child created by fork, forgets the background trim thread of the parent. m_trim_mutex must be held.
+ * The state is leaked on purpose: its thread cannot be joined or detached here, and its mutex may have been held by that thread at the time of the fork.
+ */
+void MyAlloc::drop_inherited_trim()
+{
+    if(m_trim && m_trim->pid != getpid())
+    {
+        (void)m_trim.release();
+    }
+}
+
 /*
 constexpr std::size_t MyAlloc::blocksize_to_freelist_idx(std::size_t asize) const
 {
@@ -409,13 +1568,56 @@ constexpr std::size_t MyAlloc::freelist_idx_to_blocksize(std::size_t idx) const
 }
 */
 
+/*!
+ * \brief Push the free block bptr onto the front of the explicit free list for its size class and fill in its address block
+ * \param bptr
+ */
+void MyAlloc::insert_into_freelist(BYTE* bptr)
+{
+    assert(!GET_ALLOC(HDRP(bptr)));
+
+    std::size_t idx = blocksize_to_freelist_idx(GET_SIZE(HDRP(bptr)));
+    BYTE* prevtop = m_state->free_lists.at(idx);
+
+    PUT_ADDRESS(HDRP(bptr) + HEADERSIZE, prevtop); //address of potentially nonenxistant next block
+    PUT_ADDRESS(HDRP(bptr) + HEADERSIZE + SIZE_OF_ADDRESS, nullptr); //address of nonexistant previous block
+
+    if(prevtop != nullptr)
+    {
+        PUT_ADDRESS(HDRP(prevtop) + HEADERSIZE + SIZE_OF_ADDRESS, bptr); //Put new free block as previous for potentially existing block
+    }
+
+    m_state->free_lists.at(idx) = bptr;
+
+    if(uses_free_index(idx))
+    {
+        index_insert(bptr);
+    }
+
+    if(uses_large_block_tree(idx))
+    {
+        m_state->large_block_trees.at(idx - LARGE_BLOCK_MIN_ORDER).insert(TREE_NODE(bptr), GET_SIZE(HDRP(bptr)));
+    }
+}
+
 /*!
  * \brief Remove block with block pointer bptr from the appropriate explicit free list for its size
  * \param idx
  * \param bptr
  */
 void MyAlloc::remove_from_freelist(BYTE* bptr)
-{   
+{
+    std::size_t idx = blocksize_to_freelist_idx(GET_SIZE(HDRP(bptr)));
+    if(uses_free_index(idx))
+    {
+        index_remove(bptr);
+    }
+
+    if(uses_large_block_tree(idx))
+    {
+        m_state->large_block_trees.at(idx - LARGE_BLOCK_MIN_ORDER).erase(TREE_NODE(bptr));
+    }
+
     BYTE *currptr = find_previous_block(bptr);
     if(currptr != nullptr)
     {
@@ -429,7 +1631,7 @@ void MyAlloc::remove_from_freelist(BYTE* bptr)
         return;
     }
     //If bptr is the first block in the list (because no previous block was found), change list entry to next block
-    m_free_lists.at(blocksize_to_freelist_idx(GET_SIZE(HDRP(bptr)))) = NEXT_BLKP(bptr);
+    m_state->free_lists.at(idx) = NEXT_BLKP(bptr);
 }
 
 /*!
@@ -439,7 +1641,7 @@ void MyAlloc::remove_from_freelist(BYTE* bptr)
  */
 BYTE* MyAlloc::find_previous_block(void *bp) const
 {
-    if(m_free_lists.at(blocksize_to_freelist_idx(GET_SIZE(HDRP(bp)))) == bp)
+    if(m_state->free_lists.at(blocksize_to_freelist_idx(GET_SIZE(HDRP(bp)))) == bp)
     {
         return nullptr;
     }
@@ -463,12 +1665,12 @@ void* MyAlloc::get_slab_for_block(void *blockpointer)
 {
     //take the maximum slab ptr in the slab list that is smaller than bp. Assuming nothing went wrong earlier, this MUST be the correct slab.
     //Slab MUST NOT be removed from list before doing this otherwise behavior is undefined!
-    if(m_slab_list.empty())
+    if(m_state->slab_list.empty())
     {
         throw std::runtime_error("No slab was mapped. Function call must be erroneous as there can exist no valid blockpointer.");
     }
     BYTE *slab_candidate = nullptr;
-    for(BYTE* &slabptr : m_slab_list)
+    for(BYTE* &slabptr : m_state->slab_list)
     {
         //Assume that the slab list is filled starting from the front: all nullptrs are at the back! That means we are done!
         if(slabptr == nullptr)
@@ -493,27 +1695,180 @@ void* MyAlloc::get_slab_for_block(void *blockpointer)
  * \brief Checks if the slab pointed to by the input parameter contains only free blocks. If so, removes all free blocks from the lists and unmaps the slab.
  * Behavior is undefined if slab_ptr does not point to the start of a slab!
  * \param slab_ptr
+ * \return true if the slab was unmapped
  */
-void MyAlloc::unmap_slab_if_unused(void *slab_ptr)
+bool MyAlloc::unmap_slab_if_unused(void *slab_ptr)
 {
-    //Assume that a completely free slab MUST contain ONE SINGLE block of maximum size (after all, every free-call coalesces them!)
+    //Assume that a completely free slab MUST contain ONE SINGLE block of maximum size (the coalescing sweep makes sure that it eventually does)
     //Then only check for blocksize of first block: if maximum, remove that block and unmap the slab
     BYTE *first_bp = reinterpret_cast<BYTE*>(slab_ptr) + LEFT_BOUNDARY_SIZE + HEADERSIZE;
 
-    if(GET_SIZE(HDRP(first_bp)) == MAX_BLOCK_SIZE)
+    if(!GET_ALLOC(HDRP(first_bp)) && GET_SIZE(HDRP(first_bp)) == MAX_BLOCK_SIZE)
     {
         remove_from_freelist(first_bp);
-        if(munmap(slab_ptr, SLAB_SIZE) != 0)
+        if(m_heap_fd == -1)
         {
-            throw std::runtime_error("Munmap error!");
+            SlabDirectory &directory = slab_directory();
+            std::lock_guard<std::shared_mutex> lock{directory.mutex};
+            directory.slabs.erase(reinterpret_cast<BYTE*>(slab_ptr));
         }
-        //remove slab_ptr from m_slab_list
-        auto removedIt = std::remove(m_slab_list.begin(), m_slab_list.end(), slab_ptr);
+        mem_unmap_slab(slab_ptr);
+        //remove slab_ptr from m_state->slab_list
+        auto slabIt = std::find(m_state->slab_list.begin(), m_state->slab_list.end(), slab_ptr);
+        auto removedIt = std::remove(m_state->slab_list.begin(), m_state->slab_list.end(), slab_ptr);
 
         //There had to be a slab in the map to remove at this point, otherwise a wizard is at work
-        assert(removedIt != m_slab_list.end());
+        assert(removedIt != m_state->slab_list.end());
 
         *removedIt = nullptr;
-        --m_slab_list_top_idx;
+        --m_state->slab_list_top_idx;
+        m_seen_slab_generation = ++m_state->slab_generation;
+
+        //Keep the sweep on the slab it was in, which may have moved down by one
+        auto slab_idx = static_cast<decltype(m_state->sweep_slab_idx)>(slabIt - m_state->slab_list.begin());
+        if(slab_idx < m_state->sweep_slab_idx)
+        {
+            --m_state->sweep_slab_idx;
+        }
+        else if(slab_idx == m_state->sweep_slab_idx)
+        {
+            m_state->sweep_cursor = nullptr;
+        }
+        return true;
+    }
+    return false;
+}
+
+
+/*!
+ * \brief Reads the online NUMA nodes from sysfs and creates an arena for each of them
+ */
+NumaArenas::NumaArenas()
+{
+    std::vector<int> nodes;
+
+    //Format: comma separated list of node numbers and ranges, e.g. "0-1,4"
+    std::ifstream online{"/sys/devices/system/node/online"};
+    std::string range;
+    while(std::getline(online, range, ','))
+    {
+        int first = 0;
+        int last = 0;
+        std::size_t dash = range.find('-');
+        try
+        {
+            first = std::stoi(range.substr(0, dash));
+            last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        }
+        catch(const std::exception&)
+        {
+            nodes.clear();
+            break;
+        }
+        for(int node = first; node <= last; ++node)
+        {
+            nodes.push_back(node);
+        }
+    }
+
+    if(nodes.size() <= 1)
+    {
+        m_arenas.push_back(std::make_unique<NodeArena>());
+        m_arenas.front()->node = nodes.empty() ? 0 : nodes.front();
+        m_arenas.front()->alloc = MyAlloc::get_object();
+        return;
+    }
+
+    for(int node : nodes)
+    {
+        auto arena = std::make_unique<NodeArena>();
+        arena->node = node;
+        arena->own = std::make_unique<MyAlloc>(node);
+        arena->alloc = arena->own.get();
+        m_arenas.push_back(std::move(arena));
+    }
+}
+
+/*!
+ * \brief Frees ptr in the arena it was allocated from, found through the slab directory without locking any other arena
+ * \param ptr
+ */
+void NumaArenas::free(void *ptr)
+{
+    if(m_arenas.size() == 1)
+    {
+        m_arenas.front()->alloc->free(ptr);
+        return;
+    }
+
+    MyAlloc *owner = MyAlloc::owner_of(ptr);
+    if(owner == nullptr)
+    {
+        throw std::runtime_error("Supplied block pointer does not lie in any mapped slab range and cannot be valid!");
+    }
+
+    NodeArena &local = local_node_arena();
+    if(owner == local.alloc)
+    {
+        owner->free(ptr);
+        return;
+    }
+
+    //Not through the thread cache: that would rebind it to the remote arena and flush the local blocks
+    owner->free_to_heap(ptr);
+    for(auto &arena : m_arenas)
+    {
+        if(arena->alloc == owner)
+        {
+            arena->remote_frees.fetch_add(1, std::memory_order_relaxed);
+            break;
+        }
+    }
+}
+
+/*!
+ * \brief Runs the coalescing sweep of every arena for at most budget blocks
+ * \param budget
+ * \return true if the sweeps of all arenas have passed their last slab
+ */
+bool NumaArenas::trim(std::size_t budget)
+{
+    bool done = true;
+    for(auto &arena : m_arenas)
+    {
+        done = arena->alloc->trim(budget) && done;
+    }
+    return done;
+}
+
+std::vector<NumaArenas::NodeStats> NumaArenas::stats()
+{
+    std::vector<NodeStats> retval;
+    retval.reserve(m_arenas.size());
+    for(auto &arena : m_arenas)
+    {
+        retval.push_back(NodeStats{arena->node, arena->alloc->stats(), arena->remote_frees.load(std::memory_order_relaxed)});
+    }
+    return retval;
+}
+
+/*!
+ * \brief Looks up the node the calling thread runs on right now. Threads on a node without an arena (e.g. one that came online later) use the first arena.
+ * \return
+ */
+NumaArenas::NodeArena& NumaArenas::arena_of_current_node()
+{
+    unsigned int cpu = 0;
+    unsigned int node = 0;
+    if(syscall(SYS_getcpu, &cpu, &node, nullptr) == 0)
+    {
+        for(auto &arena : m_arenas)
+        {
+            if(arena->node == static_cast<int>(node))
+            {
+                return *arena;
+            }
+        }
     }
+    return *m_arenas.front();
 }
@@ -1,8 +1,23 @@
+#pragma once
 #include "DTools/MiscTools.h"
 #include "DTools/DTSingleton.h"
+#include "freeblocktree.h"
 #include <cstdint>
 #include <array>
+#include <algorithm>
+#include <vector>
 #include <cassert>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <atomic>
+#include <pthread.h>
+#include <sys/types.h>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <stdexcept>
 
 /*Allocator, which uses its own mmapp-ed memory arenas to administrate the virtual memory. This way it does not interfere with malloc
 All memory blocks are DWORD-aligned */
@@ -12,6 +27,8 @@ All memory blocks are DWORD-aligned */
  * HEADER (1 WORD)
  * NEXTBLK (SIZE_OF_ADDRESS)
  * PREVBLK (SIZE_OF_ADDRESS)
+ * INDEXSLOT (1 DWORD, only if USE_FREE_BLOCK_INDEX)
+ * TREENODE (sizeof(FreeBlockTreeNode), only for blocks in the large size classes with LargeFitPolicy::BEST_FIT_TREE)
  * FOOTER(1 WORD)
  *
  *
@@ -34,9 +51,16 @@ constexpr std::size_t FOOTERSIZE = HEADERSIZE;
 
 constexpr long long SIZE_OF_ADDRESS = sizeof(intptr_t); //size of addresses in bytes
 
-constexpr std::size_t MIN_BLOCK_SIZE = HEADERSIZE + FOOTERSIZE + 2 * SIZE_OF_ADDRESS; //min block size in bytes INCLUDING header and footer (so min block does not include a payload!)
+//If set, every first-fit size class additionally keeps a packed array of its free blocks' sizes and addresses that find_fit scans instead of chasing the list links.
+//The position of a free block in that array is stored in the block itself, so removal stays O(1). Size classes searched through a best fit tree have no index.
+constexpr bool USE_FREE_BLOCK_INDEX = true;
 
-constexpr std::size_t OVERHEAD_SIZE = MIN_BLOCK_SIZE;
+constexpr std::size_t INDEX_SLOT_SIZE = USE_FREE_BLOCK_INDEX ? DSIZE : 0;
+
+//Overhead of an allocated block. The index slot is only used while the block is free, so it lies in the payload and only raises the minimum block size.
+constexpr std::size_t OVERHEAD_SIZE = HEADERSIZE + FOOTERSIZE + 2 * SIZE_OF_ADDRESS;
+
+constexpr std::size_t MIN_BLOCK_SIZE = OVERHEAD_SIZE + INDEX_SLOT_SIZE; //min block size in bytes INCLUDING header and footer (so min block does not include a payload!)
 
 //The min block size is supposed to be DWORD-aligned! Currently, it is assumed that SIZE_OF_ADDRESS is also DWORD-aligned! If not, the above needs to be changed!
 
@@ -56,7 +80,7 @@ constexpr std::size_t OVERHEAD_SIZE = MIN_BLOCK_SIZE;
 //Size of newly allocated slabs of memory by mmap
 constexpr std::size_t SLAB_SIZE = align_size_to_DWORD(UINT32_MAX - DSIZE);
 
-constexpr std::size_t LEFT_BOUNDARY_SIZE = OVERHEAD_SIZE + WSIZE;
+constexpr std::size_t LEFT_BOUNDARY_SIZE = MIN_BLOCK_SIZE + WSIZE;
 
 constexpr std::size_t ADMIN_OVERHEAD_SIZE = LEFT_BOUNDARY_SIZE + HEADERSIZE; //size of padding, left boundary and right boundary of a slab together
 
@@ -82,6 +106,122 @@ constexpr std::size_t MAX_BLOCK_SIZE = SLAB_SIZE - ADMIN_OVERHEAD_SIZE;
 //If this is changed, also change blocksize_to_idx and idx_to_blocksize in MyAlloc. Not very good design...
 constexpr std::size_t MAX_BLOCK_ORDER = blocksize_to_freelist_idx(MAX_BLOCK_SIZE);
 
+//How a fit is chosen in the large size classes (order >= LARGE_BLOCK_MIN_ORDER)
+enum class LargeFitPolicy
+{
+    FIRST_FIT, //same as for the small classes
+    BEST_FIT_TREE //smallest fitting block, lowest address first, found through an intrusive tree per size class
+};
+
+constexpr LargeFitPolicy LARGE_BLOCK_FIT_POLICY = LargeFitPolicy::BEST_FIT_TREE;
+
+//Size classes from this order on hold blocks larger than a page
+constexpr std::size_t LARGE_BLOCK_MIN_ORDER = 8;
+
+//Offset of the tree node from the block pointer: after next_address, previous_address and the index slot (unused in these classes, but part of every free block)
+constexpr std::size_t TREE_NODE_OFFSET = 2 * SIZE_OF_ADDRESS + INDEX_SLOT_SIZE;
+
+//Every block in a large size class must have room for the tree node in its payload
+static_assert(freelist_idx_to_blocksize(LARGE_BLOCK_MIN_ORDER - 1) >= HEADERSIZE + TREE_NODE_OFFSET + sizeof(FreeBlockTreeNode) + FOOTERSIZE);
+static_assert(LARGE_BLOCK_MIN_ORDER <= MAX_BLOCK_ORDER);
+
+//Persistent heaps (MyAlloc::open_persistent): the heap file starts with a root header, followed by the slabs
+constexpr std::size_t PERSISTENT_HEADER_REGION_SIZE = 2 * 1024 * 1024; //Room for the root header, a multiple of the page size
+constexpr std::size_t PERSISTENT_SLAB_STRIDE = std::size_t{1} << 32; //Distance between two slabs in the file and in memory. SLAB_SIZE is not page aligned, this is.
+constexpr std::uintptr_t DEFAULT_PERSISTENT_BASE = 0x200000000000; //Address at which persistent heaps are mapped unless another one is given
+constexpr std::uintptr_t DEFAULT_SHARED_ARENA_BASE = 0x300000000000; //Same for shared arenas
+constexpr std::size_t NUM_PERSISTENT_ROOTS = 32;
+constexpr std::size_t PERSISTENT_ROOT_NAME_SIZE = 48; //including terminating 0
+
+static_assert(PERSISTENT_SLAB_STRIDE >= SLAB_SIZE);
+
+constexpr int NO_NUMA_NODE = -1; //Slabs are placed wherever the kernel puts them
+
+//Gives the size of the block (including overhead and DWORD alignment) that a request for size bytes needs
+[[nodiscard]] inline constexpr std::size_t request_to_blocksize(std::size_t size)
+{
+    return align_size_to_DWORD(OVERHEAD_SIZE + size);
+}
+
+//The smallest request already needs a block of the minimum size, so block sizes of requests are never below MIN_BLOCK_SIZE
+static_assert(request_to_blocksize(1) >= MIN_BLOCK_SIZE);
+
+//Largest request malloc accepts: find_fit only takes block sizes below MAX_BLOCK_SIZE
+constexpr std::size_t MAX_REQUEST_SIZE = MAX_BLOCK_SIZE - DSIZE - OVERHEAD_SIZE;
+
+static_assert(request_to_blocksize(MAX_REQUEST_SIZE) < MAX_BLOCK_SIZE && request_to_blocksize(MAX_REQUEST_SIZE + 1) >= MAX_BLOCK_SIZE);
+
+//Requests of up to this many bytes get their size class from SMALL_SIZE_CLASS_TABLE instead of computing a logarithm
+constexpr std::size_t SMALL_SIZE_LIMIT = 1024;
+
+//Index in Freelists array for requests of up to SMALL_SIZE_LIMIT bytes, indexed by the request size in DWORDs (rounded up)
+constexpr auto SMALL_SIZE_CLASS_TABLE = []
+{
+    std::array<std::uint8_t, SMALL_SIZE_LIMIT / DSIZE + 1> table{};
+    for(std::size_t i = 0; i < table.size(); ++i)
+    {
+        table[i] = static_cast<std::uint8_t>(blocksize_to_freelist_idx(request_to_blocksize(i * DSIZE)));
+    }
+    return table;
+}();
+
+//Gives index in Freelists array for the size group that a request for size bytes fits into
+[[nodiscard]] inline constexpr std::size_t request_to_freelist_idx(std::size_t size)
+{
+    if(size <= SMALL_SIZE_LIMIT)
+    {
+        return SMALL_SIZE_CLASS_TABLE[(size + DSIZE - 1) / DSIZE];
+    }
+    return blocksize_to_freelist_idx(request_to_blocksize(size));
+}
+
+/*
+ * Per-thread cache, a layer on top of the inlined malloc above: freed blocks of small requests go into a cache of the freeing thread first,
+ * from which malloc takes blocks of exactly the same size without taking the heap lock, placing or coalescing. See MyAlloc::ThreadCache.
+ * The inlined size computation alone still leaves every malloc with a lock, a free list search and a split. Loops that free and allocate objects of one size
+ * get those down to a few loads and stores (perf_bench "malloc fast": about 80 ns/op without the cache, 45 with it, mostly timer overhead).
+ * If not set, malloc and free always go to the heap.
+ */
+constexpr bool USE_THREAD_CACHE = true;
+
+constexpr std::size_t THREAD_CACHE_MAX_BLOCKSIZE = request_to_blocksize(SMALL_SIZE_LIMIT);
+constexpr std::size_t THREAD_CACHE_NUM_BINS = (THREAD_CACHE_MAX_BLOCKSIZE - MIN_BLOCK_SIZE) / DSIZE + 1; //One bin per block size
+constexpr std::size_t THREAD_CACHE_BIN_CAPACITY = 16;
+
+//Gives the size of the largest block that still belongs to size group idx and can be allocated (find_fit only takes block sizes below MAX_BLOCK_SIZE)
+[[nodiscard]] static constexpr std::size_t freelist_idx_to_max_blocksize(std::size_t idx)
+{
+    //blocksize_to_freelist_idx divides by MIN_BLOCK_SIZE before taking the logarithm, so a group reaches up to one MIN_BLOCK_SIZE past its power of 2
+    return std::min(freelist_idx_to_blocksize(idx) + MIN_BLOCK_SIZE - DSIZE, MAX_BLOCK_SIZE - DSIZE);
+}
+
+static_assert(blocksize_to_freelist_idx(freelist_idx_to_max_blocksize(3)) == 3 && blocksize_to_freelist_idx(freelist_idx_to_max_blocksize(3) + DSIZE) == 4);
+
+//mm_malloc_at_least rounds a block up to the end of its size group if that adds no more than 1/AT_LEAST_ROUNDING_DIVISOR of the block (or less than a min block)
+constexpr std::size_t AT_LEAST_ROUNDING_DIVISOR = 8;
+
+/*!
+ * \brief Gives the block size for a request of at least size bytes, where the caller takes whatever capacity it gets.
+ * A block that reaches up to the end of its size group fits every later request of that group when it is freed, instead of being split or skipped for a slightly larger request,
+ * so it is preferred whenever the extra bytes are few enough.
+ * \param size
+ * \return
+ */
+[[nodiscard]] inline constexpr std::size_t request_to_blocksize_at_least(std::size_t size)
+{
+    const std::size_t asize = request_to_blocksize(size);
+    const std::size_t group_end = freelist_idx_to_max_blocksize(blocksize_to_freelist_idx(asize));
+
+    if(group_end - asize <= std::max(MIN_BLOCK_SIZE - DSIZE, asize / AT_LEAST_ROUNDING_DIVISOR))
+    {
+        return group_end;
+    }
+    return asize;
+}
+
+//The top size group is cut off at the largest block find_fit accepts, also for the largest requests
+static_assert(request_to_blocksize_at_least(3900000000) < MAX_BLOCK_SIZE && request_to_blocksize_at_least(MAX_REQUEST_SIZE) == MAX_BLOCK_SIZE - DSIZE);
+
 
 
 
@@ -91,18 +231,260 @@ constexpr std::size_t MAX_BLOCK_ORDER = blocksize_to_freelist_idx(MAX_BLOCK_SIZE
  */
 class MyAlloc : public dtools::DTSingleton<MyAlloc>
 {
+    friend class MyAllocBench; //Microbenchmarks in perf_bench.cpp drive the private hot paths directly
+    friend struct ThreadCacheFlusher;
+
 public:
     MyAlloc();
 
-    [[nodiscard]] void* malloc(std::size_t size);
+    /*!
+     * \brief Constructs an allocator whose slabs are placed on the NUMA node numa_node (NO_NUMA_NODE: no placement). The policy is only a preference: if the node is out of memory, pages come from other nodes.
+     * \param numa_node
+     */
+    explicit MyAlloc(int numa_node);
+
+    ~MyAlloc();
 
-    void free(void *ptr);
+    struct Stats
+    {
+        std::size_t slabs;
+        std::size_t mapped_bytes;
+        std::uint64_t malloc_calls; //Only calls that reached the heap, not those served by or freed into a thread cache
+        std::uint64_t free_calls;
+    };
+
+    /*!
+     * \brief Allocates a block with a payload of at least size bytes. Returns nullptr if size is 0 or too large, or if no more memory can be mapped.
+     * Computing the block size and size class is inlined, so for a constant size it happens at compile time.
+     * \param size
+     * \return
+     */
+    [[nodiscard]] void* malloc(std::size_t size)
+    {
+        /* Ignore spurious requests */
+        if(size == 0 || size > MAX_REQUEST_SIZE)
+            return nullptr;
+
+        return malloc_block(request_to_blocksize(size), request_to_freelist_idx(size));
+    }
+
+    /*!
+     * \brief Allocates a block with a payload of at least size bytes and sets actual to the payload size that can really be used, which may be considerably more. Sets actual to 0 on failure.
+     * \param size
+     * \param actual
+     * \return
+     */
+    [[nodiscard]] void* malloc_at_least(std::size_t size, std::size_t &actual)
+    {
+        actual = 0;
+        if(size == 0 || size > MAX_REQUEST_SIZE)
+            return nullptr;
+
+        const std::size_t asize = request_to_blocksize_at_least(size);
+        void *bp = malloc_block(asize, blocksize_to_freelist_idx(asize));
+        if(bp != nullptr)
+        {
+            actual = usable_size(bp);
+        }
+        return bp;
+    }
+
+    /*!
+     * \brief Returns the number of payload bytes of the allocated block at ptr. This is at least the requested size and includes the rest of a block that was too small to be split off.
+     * Returns 0 for nullptr, like malloc_usable_size.
+     * \param ptr
+     * \return
+     */
+    [[nodiscard]] static std::size_t usable_size(void *ptr)
+    {
+        if(ptr == nullptr)
+        {
+            return 0;
+        }
+        assert(GET_ALLOC(HDRP(ptr)));
+        return GET_SIZE(HDRP(ptr)) - OVERHEAD_SIZE;
+    }
+
+    /*!
+     * \brief Allocates a block of asize bytes (including overhead). asize must be request_to_blocksize and idx request_to_freelist_idx of the same valid request.
+     * Fast path: pops a block of exactly asize bytes from the calling thread's cache, without taking the lock.
+     * \param asize
+     * \param idx
+     * \return
+     */
+    [[nodiscard]] void* malloc_block(std::size_t asize, std::size_t idx)
+    {
+        ThreadCache &cache = s_thread_cache;
+        if(USE_THREAD_CACHE && asize <= THREAD_CACHE_MAX_BLOCKSIZE && cache.owner == this && cache.owner_id == m_instance_id)
+        {
+            const std::size_t bin = thread_cache_bin(asize);
+            cache.lock();
+            BYTE *head = cache.heads[bin];
+            if(head != nullptr)
+            {
+                cache.heads[bin] = *reinterpret_cast<BYTE**>(head);
+                --cache.counts[bin];
+            }
+            cache.unlock();
+            if(head != nullptr)
+            {
+                return head;
+            }
+        }
+        return malloc_locked(asize, idx);
+    }
+
+    /*!
+     * \brief Frees the block at ptr. Small blocks are pushed onto the calling thread's cache (still marked allocated in the heap) as long as it has room.
+     * \param ptr
+     */
+    void free(void *ptr)
+    {
+        const std::size_t size = GET_SIZE(HDRP(ptr));
+        if(USE_THREAD_CACHE && size <= THREAD_CACHE_MAX_BLOCKSIZE && m_thread_cache_enabled)
+        {
+            ThreadCache &cache = s_thread_cache;
+            if(cache.owner != this || cache.owner_id != m_instance_id)
+            {
+                if(!bind_thread_cache())
+                {
+                    free_to_heap(ptr);
+                    return;
+                }
+            }
+
+            const std::size_t bin = thread_cache_bin(size);
+            cache.lock();
+            const bool cached = cache.counts[bin] < THREAD_CACHE_BIN_CAPACITY;
+            if(cached)
+            {
+                *reinterpret_cast<BYTE**>(ptr) = cache.heads[bin];
+                cache.heads[bin] = reinterpret_cast<BYTE*>(ptr);
+                ++cache.counts[bin];
+            }
+            cache.unlock();
+            if(cached)
+            {
+                return;
+            }
+        }
+        free_to_heap(ptr);
+    }
+
+    void free_to_heap(void *ptr);
+
+    [[nodiscard]] static MyAlloc* owner_of(void *ptr);
+
+    bool trim(std::size_t budget);
+
+    [[nodiscard]] Stats stats();
+
+    [[nodiscard]] int numa_node() const
+    {
+        return m_numa_node;
+    }
+
+    void start_background_trim(std::chrono::milliseconds interval, std::size_t budget);
+
+    void stop_background_trim();
+
+    /*!
+     * \brief Opens the persistent heap stored in the file at path, or creates a new one if the file does not exist or is empty.
+     * Slabs are mapped from the file with MAP_SHARED at fixed addresses starting at base, so pointers into the heap stay valid across processes.
+     * Throws std::runtime_error if the file cannot be mapped at base, was written with a different block layout, or was not closed with close_persistent.
+     * \param path
+     * \param base
+     * \return
+     */
+    [[nodiscard]] static std::unique_ptr<MyAlloc> open_persistent(const std::string &path, std::uintptr_t base = DEFAULT_PERSISTENT_BASE);
+
+    int close_persistent(); //Also detaches from a shared arena. Afterwards, malloc, free and trim throw std::runtime_error.
+
+    /*!
+     * \brief Creates an arena in a new memfd that other processes can attach to with attach_shared_arena, e.g. after receiving shared_arena_fd() over a unix socket.
+     * A child created by fork already has the arena mapped and keeps using the allocator it inherited. A background trim thread of the parent does not run in the child,
+     * which may start its own.
+     * All processes map the arena at base and share one process-shared lock, so blocks can be handed between them as offsets (to_offset/from_offset) without copying.
+     * If a process dies while holding the lock, the arena may be half updated: from then on every operation on it throws std::runtime_error in all processes.
+     * Throws std::runtime_error if the memfd cannot be created or mapped at base.
+     * \param base
+     * \return
+     */
+    [[nodiscard]] static std::unique_ptr<MyAlloc> create_shared_arena(std::uintptr_t base = DEFAULT_SHARED_ARENA_BASE);
+
+    /*!
+     * \brief Attaches to the shared arena in the memfd fd, which is duplicated, at the base address it was created with
+     * \param fd
+     * \return
+     */
+    [[nodiscard]] static std::unique_ptr<MyAlloc> attach_shared_arena(int fd);
+
+    [[nodiscard]] int shared_arena_fd() const
+    {
+        return m_shared_arena ? m_heap_fd : -1;
+    }
+
+    //Offsets of blocks relative to the start of a persistent heap or shared arena, the same in every process
+    [[nodiscard]] std::uintptr_t to_offset(const void *ptr) const
+    {
+        assert(m_heap_base != nullptr);
+        return reinterpret_cast<const BYTE*>(ptr) - m_heap_base;
+    }
+
+    [[nodiscard]] void* from_offset(std::uintptr_t offset); //Also maps slabs other processes added to a shared arena, so the block can be accessed
+
+    void set_root(std::string_view name, void *ptr);
+
+    [[nodiscard]] void* get_root(std::string_view name);
 
 private:
+    MyAlloc(const std::string &path, std::uintptr_t base);
+
+    MyAlloc(int memfd, std::uintptr_t base);
+
+    void map_heap(int fd, std::uintptr_t base, bool is_new, bool shared, const std::string &name);
+
+    [[nodiscard]] BYTE* heap_slab_address(std::size_t pos) const
+    {
+        return m_heap_base + PERSISTENT_HEADER_REGION_SIZE + pos * PERSISTENT_SLAB_STRIDE;
+    }
+
+    [[nodiscard]] std::size_t heap_slab_position(const BYTE *slab_ptr) const
+    {
+        return (slab_ptr - m_heap_base - PERSISTENT_HEADER_REGION_SIZE) / PERSISTENT_SLAB_STRIDE;
+    }
+
+    void sync_shared_slabs();
+
+    //After close_persistent the heap is gone: falling back to anonymous memory would silently lose everything allocated afterwards
+    void throw_if_closed() const
+    {
+        if(m_closed)
+        {
+            throw std::runtime_error("Allocator was closed");
+        }
+    }
+
+    struct HeapState;
+
+    [[nodiscard]] bool slab_list_is_valid(const HeapState &state) const;
+
     int mm_init();
 
+    void open_heap_file(const std::string &path, std::uintptr_t base);
+
+    void release_heap_file();
+
+    [[nodiscard]] void* map_heap_slab(BYTE *slab_ptr, bool grow);
+
+    void rebuild_free_index();
+
     [[nodiscard]] void* mem_map_slab();
 
+    void bind_slab_to_numa_node(void *slab_ptr) const;
+
+    void free_block(void *bp);
+
     void mem_unmap_slab(void *start_of_slab);
 
     int mm_request_more_memory();
@@ -191,6 +573,46 @@ private:
         return retval;
     }
 
+    //Given block ptr bp of a free block, read its position in the free block index of its size class
+    template<typename PTR>
+    [[nodiscard]] static std::size_t GET_INDEX_SLOT(const PTR &bp)
+    {
+        assert(USE_FREE_BLOCK_INDEX && !GET_ALLOC(HDRP(bp)));
+
+        //Slot starts after header, next_address and previous_address
+        return *reinterpret_cast<DWORD*> (HDRP(bp) + HEADERSIZE + 2 * SIZE_OF_ADDRESS);
+    }
+
+    template<typename PTR>
+    static void PUT_INDEX_SLOT(const PTR &bp, std::size_t slot)
+    {
+        assert(USE_FREE_BLOCK_INDEX);
+        *reinterpret_cast<DWORD*> (HDRP(bp) + HEADERSIZE + 2 * SIZE_OF_ADDRESS) = slot;
+    }
+
+    //Given block ptr bp of a free block in a large size class, compute address of its node in the tree of that class
+    template<typename PTR>
+    [[nodiscard]] static FreeBlockTreeNode* TREE_NODE(const PTR &bp)
+    {
+        return reinterpret_cast<FreeBlockTreeNode*>(reinterpret_cast<BYTE*>(bp) + TREE_NODE_OFFSET);
+    }
+
+    [[nodiscard]] static BYTE* TREE_NODE_TO_BLKP(FreeBlockTreeNode *node)
+    {
+        return reinterpret_cast<BYTE*>(node) - TREE_NODE_OFFSET;
+    }
+
+    //The free block index is process-local, so it cannot follow changes other processes make to a shared arena. The best fit trees replace it in the large size classes.
+    [[nodiscard]] bool uses_free_index(std::size_t idx) const
+    {
+        return USE_FREE_BLOCK_INDEX && !m_shared_arena && !uses_large_block_tree(idx);
+    }
+
+    [[nodiscard]] static constexpr bool uses_large_block_tree(std::size_t idx)
+    {
+        return LARGE_BLOCK_FIT_POLICY == LargeFitPolicy::BEST_FIT_TREE && idx >= LARGE_BLOCK_MIN_ORDER;
+    }
+
     /*!
      * \brief Given block ptr bp, compute address of next block in virtual address space. That block does not need to be in the explicit lists
      * \param bp
@@ -221,45 +643,331 @@ private:
         return reinterpret_cast<BYTE*>(HDRP(bp)) - prev_blk_size + HEADERSIZE;
     }
 
+    [[nodiscard]] void* malloc_locked(std::size_t asize, std::size_t idx);
+
+    [[nodiscard]] [[gnu::cold]] void* malloc_slow(std::size_t asize);
+
     [[nodiscard]] void* find_fit(std::size_t asize);
 
+    BYTE* find_fit_in_class(std::size_t idx, std::size_t asize);
+
     BYTE* find_fit_in_list(BYTE* ptr, std::size_t asize);
 
+    BYTE* find_fit_in_index(std::size_t idx, std::size_t asize);
+
+    BYTE* find_best_fit_in_tree(std::size_t idx, std::size_t asize);
+
     void place(void *const bp, std::size_t asize);
 
     [[nodiscard]] void* coalesce(void *bp);
 
+    bool coalesce_sweep(std::size_t budget, bool unmap_unused);
+
+    void fix_sweep_cursor(BYTE *merged_bp);
+
     [[nodiscard]] BYTE* find_previous_block(void *bp) const;
 
     [[nodiscard]] void* get_slab_for_block(void *blockpointer);
-    void unmap_slab_if_unused(void *slab_ptr);
+    bool unmap_slab_if_unused(void *slab_ptr);
 
 
 
+    void insert_into_freelist(BYTE* bptr); //Push free block with block pointer bptr onto the free list for its size class
+
     void remove_from_freelist(BYTE* bptr); //Remove block with block pointer bptr from the free list given by idx in mFreelists
 
-    std::array<BYTE*, MAX_BLOCK_ORDER + 1> m_free_lists{}; //Free list for every order of 2-powers of the min block size (smallest block is order 0) - contains Block ponters, NOT HEADER POINTERS!!
+    void index_insert(BYTE* bptr);
+
+    void index_remove(BYTE* bptr);
+
+    //Everything that describes the heap itself. Lives inside the object for anonymous memory and in the root header for persistent heaps and shared arenas.
+    struct HeapState
+    {
+        std::array<BYTE*, MAX_BLOCK_ORDER + 1> free_lists{}; //Free list for every order of 2-powers of the min block size (smallest block is order 0) - contains Block ponters, NOT HEADER POINTERS!!
+
+        std::array<FreeBlockTree, MAX_BLOCK_ORDER + 1 - LARGE_BLOCK_MIN_ORDER> large_block_trees{}; //Tree for every size class from LARGE_BLOCK_MIN_ORDER on, used for LargeFitPolicy::BEST_FIT_TREE
+
+        std::array<BYTE*, MAX_HEAP / SLAB_SIZE> slab_list{}; //List of pointers to first byte of every newly mapped slab of memory. Used for unmapping during coalescing.
+        std::array<BYTE*, MAX_HEAP / SLAB_SIZE>::size_type slab_list_top_idx{0};
+        std::uint64_t slab_generation{0}; //Incremented whenever a slab is mapped or unmapped, so that other processes sharing the arena can follow
+
+        std::size_t last_freed_idx{0};
+
+        //Position of the incremental coalescing sweep: the slab in slab_list and the next block in it to look at (nullptr: start of that slab)
+        std::array<BYTE*, MAX_HEAP / SLAB_SIZE>::size_type sweep_slab_idx{0};
+        BYTE *sweep_cursor{nullptr};
+    };
+
+    HeapState m_local_state{};
+    HeapState *m_state{&m_local_state};
+
+    //Out-of-line copy of the free lists for USE_FREE_BLOCK_INDEX: sizes and block pointers of all free blocks of one size class in two parallel arrays, in no particular order
+    struct FreeBlockIndex
+    {
+        std::vector<WORD> sizes;
+        std::vector<BYTE*> blocks;
+    };
+
+    std::array<FreeBlockIndex, MAX_BLOCK_ORDER + 1> m_free_index{}; //Process-local, so not used for shared arenas
+
+    /*
+     * Blocks freed by a thread, kept allocated in the heap and linked through their first payload bytes, one list per block size.
+     * A thread's cache serves one allocator at a time, the one it last freed into. It is given back to that allocator when the thread frees into another one or exits.
+     * The allocator keeps a list of the caches bound to it, so that trim can empty the caches of all threads, also of threads that are idle.
+     * Allocators are identified by a unique id as well as their address, so a cache of a destroyed allocator is never used or flushed.
+     * Trivially destructible, so the fast paths access it without a TLS wrapper call. Flushing at thread exit is done by a separate thread_local in myalloc.cpp.
+     */
+    struct ThreadCache
+    {
+        MyAlloc *owner; //owner and owner_id are only written by the thread itself
+        std::uint64_t owner_id;
+        bool exited; //The thread is exiting and its cache was flushed for good
+        std::atomic<bool> busy; //Guards heads and counts. Only contended while trim empties the cache.
+        std::array<BYTE*, THREAD_CACHE_NUM_BINS> heads;
+        std::array<std::uint8_t, THREAD_CACHE_NUM_BINS> counts;
+
+        void lock()
+        {
+            while(busy.exchange(true, std::memory_order_acquire))
+            {
+                std::this_thread::yield();
+            }
+        }
+
+        void unlock()
+        {
+            busy.store(false, std::memory_order_release);
+        }
+    };
+
+    static_assert(THREAD_CACHE_BIN_CAPACITY <= UINT8_MAX);
+
+    [[nodiscard]] static constexpr std::size_t thread_cache_bin(std::size_t asize)
+    {
+        return (asize - MIN_BLOCK_SIZE) / DSIZE;
+    }
+
+    bool bind_thread_cache();
+
+    static void flush_thread_cache();
+
+    void drain_thread_caches();
+
+    void free_cached_blocks(ThreadCache &cache);
+
+    static std::uint64_t register_instance(MyAlloc *alloc);
+
+    static inline thread_local ThreadCache s_thread_cache{};
 
-    std::array<BYTE*, MAX_HEAP / SLAB_SIZE> m_slab_list{}; //List of pointers to first byte of every newly mapped slab of memory. Used for unmapping during coalescing.
-    std::array<BYTE*, MAX_HEAP / SLAB_SIZE>::size_type m_slab_list_top_idx{0};
+    const std::uint64_t m_instance_id{register_instance(this)};
+    std::vector<ThreadCache*> m_thread_caches; //Caches bound to this allocator, guarded by the mutex of the instance registry in myalloc.cpp
+    bool m_thread_cache_enabled{false}; //Only for anonymous memory: blocks in thread caches would stay allocated in a persistent heap file or shared arena
+
+    int m_numa_node{NO_NUMA_NODE};
+    std::uint64_t m_malloc_calls{0};
+    std::uint64_t m_free_calls{0};
 
-    std::size_t m_last_freed_idx{0};
     int consecutive_frees{0};
     unsigned int total_frees{0};
     bool m_coalesce_flag{false};
 
+    //Lockable that guards the heap: a std::mutex, or the process-shared mutex in the root header of a shared arena
+    class HeapMutex
+    {
+    public:
+        void lock();
+        void unlock();
+
+        void share(pthread_mutex_t *shared, std::uint64_t *poisoned)
+        {
+            m_shared = shared;
+            m_poisoned = poisoned;
+        }
+
+    private:
+        std::mutex m_local;
+        pthread_mutex_t *m_shared{nullptr};
+        std::uint64_t *m_poisoned{nullptr};
+    };
+
+    HeapMutex m_mutex; //Guards all of the above against the background trim thread and other processes
+
+    //Background trim thread. Allocated separately, so that a child created by fork can drop the copy it inherited: the thread itself only exists in the parent.
+    struct BackgroundTrim
+    {
+        pid_t pid; //Process that started the thread
+        std::thread thread;
+        std::mutex mutex; //Guards stop, the trim thread takes m_mutex only while it sweeps
+        std::condition_variable cv;
+        bool stop{false};
+    };
+
+    void drop_inherited_trim();
+
+    std::mutex m_trim_mutex; //Guards m_trim
+    std::unique_ptr<BackgroundTrim> m_trim;
+
+    struct PersistentRoot
+    {
+        std::array<char, PERSISTENT_ROOT_NAME_SIZE> name; //empty name: unused entry
+        BYTE *ptr;
+    };
+
+    //Stored at the start of a persistent heap file or shared arena. The allocator works directly on the heap state in here.
+    struct PersistentHeader
+    {
+        std::uint64_t magic;
+        std::uint64_t version;
+        std::uintptr_t base;
+        std::uint64_t header_size; //These four guard against opening a heap written with another block layout
+        std::uint64_t min_block_size;
+        std::uint64_t large_block_min_order;
+        std::uint64_t large_block_fit_policy; //The large block trees are only maintained with LargeFitPolicy::BEST_FIT_TREE
+        std::uint64_t clean; //0 while the heap is open: a heap that was not closed properly cannot be trusted. Not used by shared arenas.
+        std::uint64_t poisoned; //Set when a process died holding the lock of a shared arena: the heap may be half updated, so it is not used anymore
+
+        pthread_mutex_t mutex; //Process-shared, used by shared arenas only
+
+        HeapState state;
+
+        std::array<PersistentRoot, NUM_PERSISTENT_ROOTS> roots;
+    };
+
+    static_assert(sizeof(PersistentHeader) <= PERSISTENT_HEADER_REGION_SIZE);
+
+    static constexpr std::uint64_t PERSISTENT_MAGIC = 0x70616568676f6230; //"0bogheap"
+    static constexpr std::uint64_t PERSISTENT_VERSION = 4;
+
+    int m_heap_fd{-1}; //File descriptor of the heap file or memfd for persistent heaps and shared arenas, -1 for anonymous memory
+    bool m_shared_arena{false};
+    bool m_closed{false}; //Set by close_persistent
+    BYTE *m_heap_base{nullptr};
+    PersistentHeader *m_heap_header{nullptr};
+    std::array<bool, MAX_HEAP / SLAB_SIZE> m_slab_mapped{}; //Slab positions in the heap range mapped into this process
+    std::uint64_t m_seen_slab_generation{0};
+
     static constexpr int COALESCE_NUM = 20;
     static constexpr int CHECK_UNMAP_CONSEQ_NUM = 10;
     static constexpr int CHECK_UNMAP_TOTAL_NUM = 300;
+    static constexpr std::size_t SWEEP_BUDGET_ON_ALLOC_FAILURE = 4096; //Blocks the sweep may look at before a new slab is mapped
+};
+
+/*!
+ * \brief One MyAlloc per NUMA node, with its slabs placed on that node. Threads allocate from the arena of the node they run on; blocks can be freed by any thread.
+ * On a machine with a single node, or if the node topology cannot be read, there is just one arena: the MyAlloc singleton, without any placement.
+ */
+class NumaArenas : public dtools::DTSingleton<NumaArenas>
+{
+public:
+    struct NodeStats
+    {
+        int node;
+        MyAlloc::Stats arena;
+        std::uint64_t remote_frees; //Blocks of this node freed by threads running on another node
+    };
+
+    NumaArenas();
+
+    NumaArenas(const NumaArenas&) = delete;
+    NumaArenas& operator=(const NumaArenas&) = delete;
+
+    [[nodiscard]] std::size_t num_nodes() const
+    {
+        return m_arenas.size();
+    }
+
+    //Arena of the node the calling thread runs on. The node is looked up again every NODE_RECHECK_INTERVAL calls, so threads that migrate follow eventually.
+    [[nodiscard]] MyAlloc* local_arena()
+    {
+        return local_node_arena().alloc;
+    }
+
+    void free(void *ptr);
+
+    bool trim(std::size_t budget);
+
+    [[nodiscard]] std::vector<NodeStats> stats();
+
+private:
+    struct NodeArena
+    {
+        int node;
+        std::unique_ptr<MyAlloc> own; //empty for the singleton
+        MyAlloc *alloc;
+        std::atomic<std::uint64_t> remote_frees{0};
+    };
+
+    static constexpr unsigned int NODE_RECHECK_INTERVAL = 1024;
+
+    NodeArena& local_node_arena()
+    {
+        if(m_arenas.size() == 1)
+        {
+            return *m_arenas.front();
+        }
+
+        thread_local NodeArena *local{nullptr};
+        thread_local unsigned int calls{0};
+        if(local == nullptr || ++calls % NODE_RECHECK_INTERVAL == 0)
+        {
+            local = &arena_of_current_node();
+        }
+        return *local;
+    }
+
+    NodeArena& arena_of_current_node();
+
+    std::vector<std::unique_ptr<NodeArena>> m_arenas; //One per online node, in node order
 };
 
-//Free functions internally use the singleton-object
+//Free functions internally use the arena of the calling thread's NUMA node (the singleton-object on single-node machines)
 [[nodiscard]] inline void* mm_malloc(std::size_t size)
 {
-    return MyAlloc::get_object()->malloc(size);
+    return NumaArenas::get_object()->local_arena()->malloc(size);
 }
 
 inline void mm_free(void *ptr)
 {
-    MyAlloc::get_object()->free(ptr);
+    NumaArenas::get_object()->free(ptr);
+}
+
+//Payload bytes of the block at ptr (returned by any of the mm_malloc functions) that the caller may use, 0 for nullptr
+[[nodiscard]] inline std::size_t mm_usable_size(void *ptr)
+{
+    return MyAlloc::usable_size(ptr);
+}
+
+//Allocates at least size bytes and stores the usable payload size in *actual, if actual is not nullptr
+[[nodiscard]] inline void* mm_malloc_at_least(std::size_t size, std::size_t *actual)
+{
+    std::size_t usable = 0;
+    void *retval = NumaArenas::get_object()->local_arena()->malloc_at_least(size, usable);
+    if(actual != nullptr)
+    {
+        *actual = usable;
+    }
+    return retval;
+}
+
+//Allocation of a constant size: block size and size class are resolved at compile time
+template<std::size_t N>
+[[nodiscard]] inline void* mm_malloc()
+{
+    static_assert(N > 0 && N <= MAX_REQUEST_SIZE, "Invalid allocation size");
+
+    constexpr std::size_t asize = request_to_blocksize(N);
+    constexpr std::size_t idx = request_to_freelist_idx(N);
+    return NumaArenas::get_object()->local_arena()->malloc_block(asize, idx);
+}
+
+//Merges adjacent free blocks and unmaps unused slabs, looking at no more than budget blocks per node. Returns true once the sweep has passed the last slab of every node.
+//The default budget sweeps every node in full, from its first slab.
+inline bool mm_trim(std::size_t budget = SIZE_MAX)
+{
+    return NumaArenas::get_object()->trim(budget);
+}
+
+[[nodiscard]] inline std::vector<NumaArenas::NodeStats> mm_numa_stats()
+{
+    return NumaArenas::get_object()->stats();
 }
@@ -0,0 +1,358 @@
+#pragma once
+#include "myalloc.h"
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+#include <algorithm>
+#include <array>
+#include <atomic>
+
+namespace mm
+{
+
+/*!
+ * \brief Pool for objects of one fixed type T. Takes chunks of CHUNK_SIZE bytes from MyAlloc and hands out slots of sizeof(T) with the alignment of T.
+ * Objects carry no header: free slots are kept on intrusive stacks, one per chunk, and a chunk is given back to MyAlloc as soon as none of its slots are in use.
+ * Every thread keeps a small cache of free slots per pool, so most allocate/deallocate calls do not take the pool lock.
+ * A thread has caches for up to CACHES_PER_THREAD pools of the same type T at a time, so it can alternate between e.g. the node pools of a few trees without flushing.
+ */
+template<typename T, std::size_t CHUNK_SIZE = 64 * 1024>
+class ObjectPool
+{
+public:
+    ObjectPool() = default;
+
+    ObjectPool(const ObjectPool&) = delete;
+    ObjectPool& operator=(const ObjectPool&) = delete;
+
+    /*!
+     * \brief Gives all chunks back to MyAlloc. Objects that were not destroyed are not destructed.
+     * The caches of all threads that used the pool are emptied, so no thread touches the pool or its chunks afterwards. The pool must not be in use by other threads while it is destroyed.
+     */
+    ~ObjectPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock{s_bind_mutex};
+            for(ThreadCache *cache : m_caches)
+            {
+                cache->pool.store(nullptr, std::memory_order_relaxed);
+                cache->head = nullptr;
+                cache->count = 0;
+            }
+        }
+
+        for(auto &entry : m_chunks)
+        {
+            mm_free(entry.second);
+        }
+    }
+
+    template<typename... Args>
+    [[nodiscard]] T* create(Args&&... args)
+    {
+        void *slot = allocate();
+        if(slot == nullptr)
+        {
+            return nullptr;
+        }
+        return ::new(slot) T(std::forward<Args>(args)...);
+    }
+
+    void destroy(T *obj)
+    {
+        obj->~T();
+        deallocate(obj);
+    }
+
+    /*!
+     * \brief Returns an uninitialized slot for one T, or nullptr if MyAlloc is out of memory
+     */
+    [[nodiscard]] void* allocate()
+    {
+        ThreadCache &cache = own_cache();
+        if(cache.head == nullptr)
+        {
+            refill(cache);
+            if(cache.head == nullptr)
+            {
+                return nullptr;
+            }
+        }
+
+        FreeSlot *slot = cache.head;
+        cache.head = slot->next;
+        --cache.count;
+        return slot;
+    }
+
+    /*!
+     * \brief Gives back a slot that was returned by allocate() of this pool
+     */
+    void deallocate(void *ptr)
+    {
+        ThreadCache &cache = own_cache();
+
+        FreeSlot *slot = static_cast<FreeSlot*>(ptr);
+        slot->next = cache.head;
+        cache.head = slot;
+        ++cache.count;
+
+        if(cache.count > CACHE_CAPACITY)
+        {
+            flush(cache, CACHE_CAPACITY / 2);
+        }
+    }
+
+private:
+    struct FreeSlot
+    {
+        FreeSlot *next;
+    };
+
+    struct Chunk
+    {
+        FreeSlot *free_head; //Free slots of this chunk that are not in any thread cache
+        std::size_t used; //Slots handed out, including those sitting in thread caches
+        Chunk *next_partial; //Chunks with free slots form a doubly linked list
+        Chunk *prev_partial;
+        bool in_partial;
+    };
+
+    struct ThreadCache
+    {
+        std::atomic<ObjectPool*> pool{nullptr}; //Written under s_bind_mutex, also by the destructor of the pool in another thread
+        FreeSlot *head{nullptr};
+        std::size_t count{0};
+    };
+
+    static constexpr std::size_t CACHES_PER_THREAD = 4;
+
+    //The caches of one thread for pools of type T, at most one per pool
+    struct ThreadCaches
+    {
+        std::array<ThreadCache, CACHES_PER_THREAD> entries;
+        std::size_t next_victim{0}; //Entry that is taken over next when all are bound
+
+        ~ThreadCaches()
+        {
+            std::lock_guard<std::mutex> lock{s_bind_mutex};
+            for(ThreadCache &cache : entries)
+            {
+                ObjectPool *pool = cache.pool.load(std::memory_order_relaxed);
+                if(pool != nullptr)
+                {
+                    pool->unbind(cache);
+                }
+            }
+        }
+    };
+
+    static constexpr std::size_t SLOT_ALIGN = alignof(T) > alignof(FreeSlot) ? alignof(T) : alignof(FreeSlot);
+    static constexpr std::size_t SLOT_SIZE = ((sizeof(T) > sizeof(FreeSlot) ? sizeof(T) : sizeof(FreeSlot)) + SLOT_ALIGN - 1) / SLOT_ALIGN * SLOT_ALIGN;
+
+    //MyAlloc only guarantees DWORD alignment, so stricter alignments need some room to shift the first slot
+    static constexpr std::size_t ALIGN_SLACK = SLOT_ALIGN > DSIZE ? SLOT_ALIGN - DSIZE : 0;
+    static constexpr std::size_t SLOTS_PER_CHUNK = (CHUNK_SIZE - sizeof(Chunk) - ALIGN_SLACK) / SLOT_SIZE;
+
+    static constexpr std::size_t CACHE_CAPACITY = 64;
+
+    static_assert(CHUNK_SIZE > sizeof(Chunk) + ALIGN_SLACK + SLOT_SIZE, "CHUNK_SIZE too small for one object");
+
+    //Returns the cache of the calling thread for this pool
+    ThreadCache& own_cache()
+    {
+        ThreadCaches &caches = s_caches;
+        for(ThreadCache &cache : caches.entries)
+        {
+            if(cache.pool.load(std::memory_order_relaxed) == this)
+            {
+                return cache;
+            }
+        }
+        return bind_cache(caches);
+    }
+
+    //Binds an unused cache of the calling thread to this pool. If all are bound, they are taken over from the other pools in turn.
+    ThreadCache& bind_cache(ThreadCaches &caches)
+    {
+        std::lock_guard<std::mutex> lock{s_bind_mutex};
+
+        auto unused = std::find_if(caches.entries.begin(), caches.entries.end(), [](const ThreadCache &cache)
+        {
+            return cache.pool.load(std::memory_order_relaxed) == nullptr;
+        });
+
+        ThreadCache *cache = nullptr;
+        if(unused != caches.entries.end())
+        {
+            cache = &*unused;
+        }
+        else
+        {
+            cache = &caches.entries[caches.next_victim];
+            caches.next_victim = (caches.next_victim + 1) % CACHES_PER_THREAD;
+            cache->pool.load(std::memory_order_relaxed)->unbind(*cache);
+        }
+
+        cache->pool.store(this, std::memory_order_relaxed);
+        m_caches.push_back(cache);
+        return *cache;
+    }
+
+    //Gives all slots of cache back and forgets about it. s_bind_mutex must be held.
+    void unbind(ThreadCache &cache)
+    {
+        flush(cache, cache.count);
+        m_caches.erase(std::find(m_caches.begin(), m_caches.end(), &cache));
+        cache.pool.store(nullptr, std::memory_order_relaxed);
+    }
+
+    //Moves up to CACHE_CAPACITY / 2 free slots into cache, mapping a new chunk if no chunk has free slots left
+    void refill(ThreadCache &cache)
+    {
+        std::lock_guard<std::mutex> lock{m_mutex};
+
+        while(cache.count < CACHE_CAPACITY / 2)
+        {
+            if(m_partial == nullptr && !add_chunk())
+            {
+                return;
+            }
+
+            Chunk *chunk = m_partial;
+            FreeSlot *slot = chunk->free_head;
+            chunk->free_head = slot->next;
+            ++chunk->used;
+
+            if(chunk->free_head == nullptr)
+            {
+                unlink_partial(chunk);
+            }
+
+            slot->next = cache.head;
+            cache.head = slot;
+            ++cache.count;
+        }
+    }
+
+    //Gives num slots from the top of cache back to their chunks. Chunks that become unused are freed.
+    void flush(ThreadCache &cache, std::size_t num)
+    {
+        std::lock_guard<std::mutex> lock{m_mutex};
+
+        for(std::size_t i = 0; i < num && cache.head != nullptr; ++i)
+        {
+            FreeSlot *slot = cache.head;
+            cache.head = slot->next;
+            --cache.count;
+
+            Chunk *chunk = chunk_of(slot);
+            slot->next = chunk->free_head;
+            chunk->free_head = slot;
+            --chunk->used;
+
+            if(chunk->used == 0)
+            {
+                if(chunk->in_partial)
+                {
+                    unlink_partial(chunk);
+                }
+                m_chunks.erase(reinterpret_cast<BYTE*>(chunk));
+                mm_free(chunk);
+            }
+            else if(!chunk->in_partial)
+            {
+                link_partial(chunk);
+            }
+        }
+    }
+
+    //Takes a new chunk from MyAlloc and threads all of its slots onto its free stack. m_mutex must be held.
+    bool add_chunk()
+    {
+        void *mem = mm_malloc(CHUNK_SIZE);
+        if(mem == nullptr)
+        {
+            return false;
+        }
+
+        Chunk *chunk = ::new(mem) Chunk{nullptr, 0, nullptr, nullptr, false};
+
+        void *first = reinterpret_cast<BYTE*>(mem) + sizeof(Chunk);
+        std::size_t space = CHUNK_SIZE - sizeof(Chunk);
+        first = std::align(SLOT_ALIGN, SLOTS_PER_CHUNK * SLOT_SIZE, first, space);
+        assert(first != nullptr);
+
+        //Thread in reverse, so that slots are handed out in address order
+        for(std::size_t i = SLOTS_PER_CHUNK; i-- > 0;)
+        {
+            FreeSlot *slot = reinterpret_cast<FreeSlot*>(reinterpret_cast<BYTE*>(first) + i * SLOT_SIZE);
+            slot->next = chunk->free_head;
+            chunk->free_head = slot;
+        }
+
+        m_chunks.emplace(reinterpret_cast<BYTE*>(chunk), chunk);
+        link_partial(chunk);
+        return true;
+    }
+
+    //The chunk containing slot is the one with the highest start address not above it. m_mutex must be held.
+    Chunk* chunk_of(FreeSlot *slot) const
+    {
+        auto it = m_chunks.upper_bound(reinterpret_cast<BYTE*>(slot));
+        assert(it != m_chunks.begin());
+        --it;
+        assert(reinterpret_cast<BYTE*>(slot) < it->first + CHUNK_SIZE);
+        return it->second;
+    }
+
+    void link_partial(Chunk *chunk)
+    {
+        chunk->prev_partial = nullptr;
+        chunk->next_partial = m_partial;
+        if(m_partial != nullptr)
+        {
+            m_partial->prev_partial = chunk;
+        }
+        m_partial = chunk;
+        chunk->in_partial = true;
+    }
+
+    void unlink_partial(Chunk *chunk)
+    {
+        if(chunk->prev_partial != nullptr)
+        {
+            chunk->prev_partial->next_partial = chunk->next_partial;
+        }
+        else
+        {
+            m_partial = chunk->next_partial;
+        }
+        if(chunk->next_partial != nullptr)
+        {
+            chunk->next_partial->prev_partial = chunk->prev_partial;
+        }
+        chunk->in_partial = false;
+    }
+
+    static thread_local ThreadCaches s_caches;
+    static std::mutex s_bind_mutex; //Guards binding caches to pools and m_caches of all pools of this type, so that thread exit and pool destruction do not race
+
+    std::mutex m_mutex; //Guards everything below, thread caches need no lock
+    std::map<BYTE*, Chunk*> m_chunks; //All chunks by start address, to find the chunk of a slot
+    Chunk *m_partial{nullptr}; //Chunks that have free slots
+
+    std::vector<ThreadCache*> m_caches; //Thread caches bound to this pool, guarded by s_bind_mutex
+};
+
+template<typename T, std::size_t CHUNK_SIZE>
+thread_local typename ObjectPool<T, CHUNK_SIZE>::ThreadCaches ObjectPool<T, CHUNK_SIZE>::s_caches;
+
+template<typename T, std::size_t CHUNK_SIZE>
+std::mutex ObjectPool<T, CHUNK_SIZE>::s_bind_mutex;
+
+}
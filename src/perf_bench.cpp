@@ -0,0 +1,288 @@
+#include <iostream>
+#include <array>
+#include <iomanip>
+#include <vector>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string_view>
+#include "myalloc.h"
+#include "perfcounters.h"
+#include "objectpool.h"
+
+/*Microbenchmarks for the individual hot paths of MyAlloc, measured with hardware performance counters.
+Every operation is bracketed by its own start/stop of the counter group, so set-up work done between operations is not counted.
+The enable/disable ioctls themselves add a small constant number of user-space instructions per operation.
+If the counters cannot be opened, only the wall-clock time per operation is reported. */
+
+class MyAllocBench
+{
+public:
+    struct Result
+    {
+        std::string_view name;
+        std::size_t ops{0};
+        std::chrono::duration<double, std::nano> elapsed{0};
+        PerfCounters::Values counts{};
+    };
+
+    MyAllocBench(std::size_t num_blocks, unsigned int seed) : m_num_blocks{num_blocks}, m_rng{seed} {}
+
+    /*!
+     * \brief Searches a heap fragmented by freeing every other block, without modifying it
+     */
+    Result bench_find_fit()
+    {
+        auto alloc = std::make_unique<MyAlloc>();
+        fragment_heap(*alloc);
+
+        Result res{"find_fit"};
+        m_counters.reset();
+        for(std::size_t i = 0; i < m_num_blocks; ++i)
+        {
+            std::size_t asize = random_asize();
+            measure(res, [&]{ volatile void *bp = alloc->find_fit(asize); (void)bp; });
+        }
+        res.counts = m_counters.read_values();
+        return res;
+    }
+
+    /*!
+     * \brief Places blocks found by find_fit (which is not counted) into the fragmented heap
+     */
+    Result bench_place()
+    {
+        auto alloc = std::make_unique<MyAlloc>();
+        fragment_heap(*alloc);
+
+        Result res{"place"};
+        m_counters.reset();
+        for(std::size_t i = 0; i < m_num_blocks; ++i)
+        {
+            std::size_t asize = random_asize();
+            void *bp = alloc->find_fit(asize);
+            if(bp == nullptr)
+            {
+                break;
+            }
+            measure(res, [&]{ alloc->place(bp, asize); });
+        }
+        res.counts = m_counters.read_values();
+        return res;
+    }
+
+    /*!
+     * \brief Frees blocks whose physical neighbours are already free and coalesces them
+     */
+    Result bench_coalesce()
+    {
+        auto alloc = std::make_unique<MyAlloc>();
+        std::vector<void*> ptrs = allocate_adjacent(*alloc);
+
+        for(std::size_t i = 0; i < ptrs.size(); i += 2)
+        {
+            alloc->free_to_heap(ptrs.at(i));
+        }
+
+        Result res{"coalesce"};
+        m_counters.reset();
+        for(std::size_t i = 1; i < ptrs.size(); i += 2)
+        {
+            void *bp = ptrs.at(i);
+            mark_free(bp);
+            measure(res, [&]{ bp = alloc->coalesce(bp); });
+            alloc->insert_into_freelist(reinterpret_cast<BYTE*>(bp));
+        }
+        res.counts = m_counters.read_values();
+        return res;
+    }
+
+    /*!
+     * \brief Pushes freed blocks onto their free lists without coalescing
+     */
+    Result bench_freelist_insert()
+    {
+        auto alloc = std::make_unique<MyAlloc>();
+        std::vector<void*> ptrs = allocate_adjacent(*alloc);
+
+        Result res{"freelist insert"};
+        m_counters.reset();
+        for(void *bp : ptrs)
+        {
+            mark_free(bp);
+            measure(res, [&]{ alloc->insert_into_freelist(reinterpret_cast<BYTE*>(bp)); });
+        }
+        res.counts = m_counters.read_values();
+        return res;
+    }
+
+    /*!
+     * \brief Frees and reallocates blocks of one constant size, which is served by the thread cache
+     */
+    Result bench_malloc_fast_path()
+    {
+        auto alloc = std::make_unique<MyAlloc>();
+        std::vector<void*> ptrs = allocate_adjacent(*alloc);
+
+        Result res{"malloc fast"};
+        m_counters.reset();
+        for(void *&bp : ptrs)
+        {
+            alloc->free(bp);
+            measure(res, [&]{ bp = alloc->malloc(MAX_BENCH_MALLOC_SIZE / 4); });
+        }
+        res.counts = m_counters.read_values();
+        return res;
+    }
+
+    /*!
+     * \brief Allocates fixed-size nodes from an ObjectPool, then frees and reallocates each of them, for comparison with the malloc fast path
+     */
+    Result bench_object_pool()
+    {
+        struct Node
+        {
+            std::array<BYTE, MAX_BENCH_MALLOC_SIZE / 4> payload;
+        };
+
+        mm::ObjectPool<Node> pool;
+        std::vector<void*> ptrs;
+        ptrs.reserve(m_num_blocks);
+        for(std::size_t i = 0; i < m_num_blocks; ++i)
+        {
+            ptrs.push_back(pool.allocate());
+        }
+
+        Result res{"pool allocate"};
+        m_counters.reset();
+        for(void *&slot : ptrs)
+        {
+            pool.deallocate(slot);
+            measure(res, [&]{ slot = pool.allocate(); });
+        }
+        res.counts = m_counters.read_values();
+
+        for(void *slot : ptrs)
+        {
+            pool.deallocate(slot);
+        }
+        return res;
+    }
+
+    [[nodiscard]] const PerfCounters& counters() const
+    {
+        return m_counters;
+    }
+
+private:
+    static constexpr std::size_t MAX_BENCH_MALLOC_SIZE = 4096;
+
+    template<typename Op>
+    void measure(Result &res, Op &&op)
+    {
+        m_counters.start();
+        const auto start{std::chrono::steady_clock::now()};
+        op();
+        const auto end{std::chrono::steady_clock::now()};
+        m_counters.stop();
+
+        res.elapsed += end - start;
+        ++res.ops;
+    }
+
+    std::size_t random_asize()
+    {
+        std::uniform_int_distribution<std::size_t> dist{1, MAX_BENCH_MALLOC_SIZE};
+        return align_size_to_DWORD(OVERHEAD_SIZE + dist(m_rng));
+    }
+
+    //Allocates m_num_blocks blocks of random size and frees every other one, leaving many small free blocks in the lists
+    void fragment_heap(MyAlloc &alloc)
+    {
+        std::uniform_int_distribution<std::size_t> dist{1, MAX_BENCH_MALLOC_SIZE};
+        std::vector<void*> ptrs;
+        ptrs.reserve(m_num_blocks);
+        for(std::size_t i = 0; i < m_num_blocks; ++i)
+        {
+            ptrs.push_back(alloc.malloc(dist(m_rng)));
+        }
+        for(std::size_t i = 0; i < ptrs.size(); i += 2)
+        {
+            alloc.free_to_heap(ptrs.at(i));
+        }
+    }
+
+    //Blocks split off the front of a fresh slab lie next to each other in the order they were allocated
+    std::vector<void*> allocate_adjacent(MyAlloc &alloc)
+    {
+        std::vector<void*> ptrs;
+        ptrs.reserve(m_num_blocks);
+        for(std::size_t i = 0; i < m_num_blocks; ++i)
+        {
+            ptrs.push_back(alloc.malloc(MAX_BENCH_MALLOC_SIZE / 4));
+        }
+        return ptrs;
+    }
+
+    //What MyAlloc::free does to a block before it is coalesced or put on a list
+    static void mark_free(void *bp)
+    {
+        std::size_t size = MyAlloc::GET_SIZE(MyAlloc::HDRP(bp));
+        MyAlloc::PUT_WORD(MyAlloc::HDRP(bp), MyAlloc::PACK(size, 0));
+        MyAlloc::PUT_WORD(MyAlloc::FTRP(bp), MyAlloc::PACK(size, 0));
+    }
+
+    std::size_t m_num_blocks;
+    std::mt19937 m_rng;
+    PerfCounters m_counters;
+};
+
+static void print_result(const MyAllocBench::Result &res, const PerfCounters &counters)
+{
+    const double ops = res.ops == 0 ? 1.0 : static_cast<double>(res.ops);
+
+    std::cout << std::left << std::setw(16) << res.name << std::right
+              << std::setw(10) << res.ops
+              << std::setw(12) << std::fixed << std::setprecision(1) << res.elapsed.count() / ops;
+
+    for(std::size_t ev = 0; ev < PerfCounters::NUM_EVENTS; ++ev)
+    {
+        std::cout << std::setw(14);
+        if(counters.available(static_cast<PerfCounters::Event>(ev)))
+        {
+            std::cout << std::fixed << std::setprecision(2) << static_cast<double>(res.counts.at(ev)) / ops;
+        }
+        else
+        {
+            std::cout << "n/a";
+        }
+    }
+    std::cout << "\n";
+}
+
+int main()
+{
+    constexpr std::size_t NUM_OF_BLOCKS = 20000;
+    constexpr unsigned int SEED = 42;
+
+    MyAllocBench bench{NUM_OF_BLOCKS, SEED};
+
+    if(!bench.counters().available())
+    {
+        std::cout << "Hardware performance counters are unavailable (check /proc/sys/kernel/perf_event_paranoid), reporting wall-clock time only\n";
+    }
+
+    std::cout << std::left << std::setw(16) << "operation" << std::right << std::setw(10) << "ops" << std::setw(12) << "ns/op";
+    for(std::size_t ev = 0; ev < PerfCounters::NUM_EVENTS; ++ev)
+    {
+        std::cout << std::setw(14) << PerfCounters::event_name(static_cast<PerfCounters::Event>(ev));
+    }
+    std::cout << "\n";
+
+    print_result(bench.bench_find_fit(), bench.counters());
+    print_result(bench.bench_place(), bench.counters());
+    print_result(bench.bench_coalesce(), bench.counters());
+    print_result(bench.bench_freelist_insert(), bench.counters());
+    print_result(bench.bench_malloc_fast_path(), bench.counters());
+    print_result(bench.bench_object_pool(), bench.counters());
+}
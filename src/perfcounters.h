@@ -0,0 +1,169 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <utility>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/*Thin wrapper around perf_event_open for counting hardware events around small sections of code.
+All counters are opened as one group, so they are enabled and disabled together with a single ioctl.
+Counters that the kernel or the CPU does not support are simply left out. If not even the group leader can be opened
+(no PMU in a VM, perf_event_paranoid too strict, ...) available() returns false and every read yields zeroes. */
+
+//Encodes a PERF_TYPE_HW_CACHE event as described in perf_event_open(2)
+[[nodiscard]] inline constexpr std::uint64_t perf_cache_config(std::uint64_t cache, std::uint64_t op, std::uint64_t result)
+{
+    return cache | (op << 8) | (result << 16);
+}
+
+class PerfCounters
+{
+public:
+    enum Event : std::size_t
+    {
+        CYCLES = 0,
+        INSTRUCTIONS,
+        L1D_MISSES,
+        LLC_MISSES,
+        DTLB_MISSES,
+        NUM_EVENTS
+    };
+
+    using Values = std::array<std::uint64_t, NUM_EVENTS>;
+
+    PerfCounters()
+    {
+        static constexpr std::array<std::pair<std::uint32_t, std::uint64_t>, NUM_EVENTS> events{{
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+            {PERF_TYPE_HW_CACHE, perf_cache_config(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+            {PERF_TYPE_HW_CACHE, perf_cache_config(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+        }};
+
+        m_fds.fill(-1);
+        for(std::size_t i = 0; i < NUM_EVENTS; ++i)
+        {
+            m_fds.at(i) = open_counter(events.at(i).first, events.at(i).second, m_leader_fd);
+            if(m_fds.at(i) != -1 && m_leader_fd == -1)
+            {
+                m_leader_fd = m_fds.at(i);
+            }
+        }
+    }
+
+    ~PerfCounters()
+    {
+        for(int fd : m_fds)
+        {
+            if(fd != -1)
+            {
+                close(fd);
+            }
+        }
+    }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    [[nodiscard]] bool available() const
+    {
+        return m_leader_fd != -1;
+    }
+
+    [[nodiscard]] bool available(Event ev) const
+    {
+        return m_fds.at(ev) != -1;
+    }
+
+    void reset()
+    {
+        if(available())
+        {
+            ioctl(m_leader_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        }
+    }
+
+    //Counting accumulates over consecutive start/stop pairs until reset() is called
+    void start()
+    {
+        if(available())
+        {
+            ioctl(m_leader_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        }
+    }
+
+    void stop()
+    {
+        if(available())
+        {
+            ioctl(m_leader_fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+        }
+    }
+
+    /*!
+     * \brief Reads the accumulated counts. Counts are scaled up if the kernel had to multiplex the group.
+     * Events that could not be opened read as 0.
+     */
+    [[nodiscard]] Values read_values() const
+    {
+        Values result{};
+        if(!available())
+        {
+            return result;
+        }
+
+        //Layout for PERF_FORMAT_GROUP | TOTAL_TIME_ENABLED | TOTAL_TIME_RUNNING: nr, time_enabled, time_running, values[nr]
+        std::array<std::uint64_t, 3 + NUM_EVENTS> buf{};
+        if(::read(m_leader_fd, buf.data(), sizeof(buf)) <= 0)
+        {
+            return result;
+        }
+
+        const std::uint64_t nr = buf.at(0);
+        const double scale = buf.at(2) == 0 ? 0.0 : static_cast<double>(buf.at(1)) / static_cast<double>(buf.at(2));
+
+        //Values come in the order the events were added to the group, skipping those that failed to open
+        std::size_t value_idx = 0;
+        for(std::size_t i = 0; i < NUM_EVENTS && value_idx < nr; ++i)
+        {
+            if(m_fds.at(i) == -1)
+            {
+                continue;
+            }
+            result.at(i) = static_cast<std::uint64_t>(static_cast<double>(buf.at(3 + value_idx)) * scale);
+            ++value_idx;
+        }
+        return result;
+    }
+
+    [[nodiscard]] static std::string_view event_name(Event ev)
+    {
+        static constexpr std::array<std::string_view, NUM_EVENTS> names{"cycles", "instructions", "L1d-misses", "LLC-misses", "dTLB-misses"};
+        return names.at(ev);
+    }
+
+private:
+    [[nodiscard]] static int open_counter(std::uint32_t type, std::uint64_t config, int group_fd)
+    {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = group_fd == -1 ? 1 : 0; //Only the leader starts disabled, members follow it
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        long fd = syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+        return fd < 0 ? -1 : static_cast<int>(fd);
+    }
+
+    std::array<int, NUM_EVENTS> m_fds{};
+    int m_leader_fd{-1};
+};
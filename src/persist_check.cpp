@@ -0,0 +1,125 @@
+#include <iostream>
+#include <string>
+#include <stdexcept>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "myalloc.h"
+
+/*Round trip through a persistent heap on tmpfs: build a linked list, close the heap, reopen it and walk the list from its root.
+Also checks that a closed handle refuses to allocate and that a heap that was not closed or whose file was truncated is refused on open.
+Exits with 0 if all checks pass. The heap file is created in /dev/shm unless another directory is given as first argument. */
+
+struct ListNode
+{
+    ListNode *next;
+    std::size_t value;
+};
+
+static int failures = 0;
+
+static void check(bool condition, const std::string &what)
+{
+    std::cout << (condition ? "ok      " : "FAILED  ") << what << "\n";
+    if(!condition)
+    {
+        ++failures;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    constexpr std::size_t NUM_OF_NODES = 10000;
+
+    const std::string dir = argc > 1 ? argv[1] : "/dev/shm";
+    const std::string path = dir + "/bogomalloc_persist_check_" + std::to_string(getpid());
+    unlink(path.c_str());
+
+    //Write
+    {
+        auto heap = MyAlloc::open_persistent(path);
+        ListNode *head = nullptr;
+        for(std::size_t i = 0; i < NUM_OF_NODES; ++i)
+        {
+            auto *node = static_cast<ListNode*>(heap->malloc(sizeof(ListNode)));
+            node->next = head;
+            node->value = i;
+            head = node;
+        }
+        heap->set_root("list", head);
+        check(heap->close_persistent() == 0, "close after write");
+
+        bool threw = false;
+        try
+        {
+            void *ptr = heap->malloc(sizeof(ListNode));
+            (void)ptr;
+        }
+        catch(const std::runtime_error&)
+        {
+            threw = true;
+        }
+        check(threw, "malloc on a closed heap throws");
+    }
+
+    //Reopen and read
+    {
+        auto heap = MyAlloc::open_persistent(path);
+        std::size_t count = 0;
+        std::size_t sum = 0;
+        for(auto *node = static_cast<ListNode*>(heap->get_root("list")); node != nullptr; node = node->next)
+        {
+            ++count;
+            sum += node->value;
+        }
+        check(count == NUM_OF_NODES && sum == NUM_OF_NODES * (NUM_OF_NODES - 1) / 2, "list intact after reopen");
+        check(heap->get_root("missing") == nullptr, "unknown root is nullptr");
+        check(heap->close_persistent() == 0, "close after read");
+    }
+
+    //A child opens the heap and exits without closing it, as a crash would
+    pid_t child = fork();
+    if(child == 0)
+    {
+        auto heap = MyAlloc::open_persistent(path);
+        _exit(0);
+    }
+    int status = 0;
+    waitpid(child, &status, 0);
+
+    bool refused = false;
+    try
+    {
+        auto heap = MyAlloc::open_persistent(path);
+    }
+    catch(const std::runtime_error&)
+    {
+        refused = true;
+    }
+    check(WIFEXITED(status) && refused, "heap that was not closed is refused");
+
+    //A heap file cut off behind the root header has lost its slabs
+    unlink(path.c_str());
+    {
+        auto heap = MyAlloc::open_persistent(path);
+        void *ptr = heap->malloc(sizeof(ListNode));
+        heap->set_root("node", ptr);
+        heap->close_persistent();
+    }
+    refused = false;
+    try
+    {
+        if(truncate(path.c_str(), PERSISTENT_HEADER_REGION_SIZE) == 0)
+        {
+            auto heap = MyAlloc::open_persistent(path);
+        }
+    }
+    catch(const std::runtime_error&)
+    {
+        refused = true;
+    }
+    check(refused, "truncated heap file is refused");
+
+    unlink(path.c_str());
+    std::cout << (failures == 0 ? "All persistent heap checks passed\n" : "Persistent heap checks FAILED\n");
+    return failures == 0 ? 0 : 1;
+}
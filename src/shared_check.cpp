@@ -0,0 +1,162 @@
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <stdexcept>
+#include <csignal>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "myalloc.h"
+
+/*Cross-process checks of a shared arena: a child attaches through the memfd, frees a block of the parent and allocates one for it.
+A child created by fork while the parent runs background trim can use and close the arena it inherited.
+A process killed while holding the arena lock poisons the arena for all processes.
+Exits with 0 if all checks pass. */
+
+static int failures = 0;
+
+static void check(bool condition, const std::string &what)
+{
+    std::cout << (condition ? "ok      " : "FAILED  ") << what << "\n";
+    if(!condition)
+    {
+        ++failures;
+    }
+}
+
+static bool exited_with(int status, int code)
+{
+    return WIFEXITED(status) && WEXITSTATUS(status) == code;
+}
+
+template<typename F>
+static bool throws_runtime_error(F &&fn)
+{
+    try
+    {
+        fn();
+    }
+    catch(const std::runtime_error&)
+    {
+        return true;
+    }
+    return false;
+}
+
+//In a forked child: drops the inherited mapping of the arena and attaches to it again through its memfd
+static std::unique_ptr<MyAlloc> reattach(std::unique_ptr<MyAlloc> &inherited)
+{
+    int fd = dup(inherited->shared_arena_fd());
+    inherited->close_persistent();
+    auto arena = MyAlloc::attach_shared_arena(fd);
+    close(fd);
+    return arena;
+}
+
+int main()
+{
+    constexpr std::size_t MSG_SIZE = 64;
+    constexpr int MAX_KILL_ATTEMPTS = 50;
+
+    auto arena = MyAlloc::create_shared_arena();
+
+    //Attach, free a block of the parent and allocate one for the parent
+    {
+        auto *msg = static_cast<char*>(arena->malloc(MSG_SIZE));
+        std::strcpy(msg, "from parent");
+        arena->set_root("parent", msg);
+
+        pid_t child = fork();
+        if(child == 0)
+        {
+            auto attached = reattach(arena);
+            auto *parent_msg = static_cast<char*>(attached->get_root("parent"));
+            if(parent_msg == nullptr || std::strcmp(parent_msg, "from parent") != 0)
+            {
+                _exit(1);
+            }
+            attached->free(parent_msg);
+            attached->set_root("parent", nullptr);
+
+            auto *child_msg = static_cast<char*>(attached->malloc(MSG_SIZE));
+            std::strcpy(child_msg, "from child");
+            attached->set_root("child", child_msg);
+            _exit(0);
+        }
+        int status = 0;
+        waitpid(child, &status, 0);
+        check(exited_with(status, 0), "child attaches and frees a block of the parent");
+
+        auto *child_msg = static_cast<char*>(arena->get_root("child"));
+        check(child_msg != nullptr && std::strcmp(child_msg, "from child") == 0, "block allocated by child is visible in parent");
+        check(arena->get_root("parent") == nullptr, "root removed by child is gone in parent");
+        if(child_msg != nullptr)
+        {
+            arena->free(child_msg);
+            arena->set_root("child", nullptr);
+        }
+    }
+
+    //A forked child inherits the allocator, but not the background trim thread
+    {
+        arena->start_background_trim(std::chrono::milliseconds(10), 1000);
+        usleep(50000);
+
+        pid_t child = fork();
+        if(child == 0)
+        {
+            alarm(10);
+            void *ptr = arena->malloc(MSG_SIZE);
+            arena->free(ptr);
+            arena.reset();
+            _exit(0);
+        }
+        int status = 0;
+        waitpid(child, &status, 0);
+        check(exited_with(status, 0), "forked child closes arena with background trim of parent");
+
+        arena->stop_background_trim();
+        check(arena->trim(SIZE_MAX), "arena usable after child exited");
+    }
+    arena.reset();
+
+    //Kill children while they allocate, until one dies holding the lock. Allocations in the arena happen almost entirely under the lock.
+    arena = MyAlloc::create_shared_arena();
+    bool poisoned = false;
+    for(int attempt = 0; attempt < MAX_KILL_ATTEMPTS && !poisoned; ++attempt)
+    {
+        pid_t child = fork();
+        if(child == 0)
+        {
+            for(;;)
+            {
+                void *ptr = arena->malloc(4096);
+                arena->free(ptr);
+            }
+        }
+        usleep(20000);
+        kill(child, SIGKILL);
+        waitpid(child, nullptr, 0);
+
+        void *ptr = nullptr;
+        poisoned = throws_runtime_error([&]{ ptr = arena->malloc(MSG_SIZE); });
+        if(!poisoned)
+        {
+            arena->free(ptr);
+        }
+    }
+    check(poisoned, "process killed holding the lock poisons the arena");
+    check(throws_runtime_error([&]{ arena->trim(SIZE_MAX); }), "poisoned arena keeps throwing");
+
+    pid_t child = fork();
+    if(child == 0)
+    {
+        _exit(throws_runtime_error([&]{ reattach(arena); }) ? 0 : 1);
+    }
+    int status = 0;
+    waitpid(child, &status, 0);
+    check(exited_with(status, 0), "attaching to a poisoned arena is refused");
+
+    arena.reset();
+    std::cout << (failures == 0 ? "All shared arena checks passed\n" : "Shared arena checks FAILED\n");
+    return failures == 0 ? 0 : 1;
+}